@@ -0,0 +1,313 @@
+/*******************************************************************************
+ * BAREFOOT NETWORKS CONFIDENTIAL & PROPRIETARY
+ *
+ * Copyright (c) 2015-2016 Barefoot Networks, Inc.
+
+ * All Rights Reserved.
+ *
+ * NOTICE: All information contained herein is, and remains the property of
+ * Barefoot Networks, Inc. and its suppliers, if any. The intellectual and
+ * technical concepts contained herein are proprietary to Barefoot Networks,
+ * Inc.
+ * and its suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material is
+ * strictly forbidden unless prior written permission is obtained from
+ * Barefoot Networks, Inc.
+ *
+ * No warranty, explicit or implicit is provided, unless granted under a
+ * written agreement with Barefoot Networks, Inc.
+ *
+ * $Id: $
+ *
+ ******************************************************************************/
+/**
+ *
+ * GPL LICENSE SUMMARY
+ *
+ *   Copyright(c) 2015 Barefoot Networks. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of version 2 of the GNU General Public License as
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the...
+ *
+ **/
+
+/* bf_kdrv ioctl interface
+ *
+ * Shared between the bf_kdrv kernel module and the user space driver that
+ * opens /dev/bf<n>.
+ */
+
+#ifndef _BF_IOCTL_H_
+#define _BF_IOCTL_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define BF_IOC_MAGIC 'b'
+
+/* mmap() offsets, in units of the page size. Offsets 0 to 5 map BAR0 to
+ * BAR5 from their start. BF_MMAP_EVENT_PGOFF maps, read-only, the page
+ * holding the s32 per vector interrupt counters that read() reports.
+ */
+#define BF_MMAP_EVENT_PGOFF 6
+/* DMA buffer <id> is mapped at page offset BF_MMAP_DMA_PGOFF_BASE + id, as
+ * returned in bf_dma_alloc.mmap_offset
+ */
+#define BF_MMAP_DMA_PGOFF_BASE 0x1000
+/* a BAR can also be mapped from a page offset into it: pass
+ * BF_MMAP_BAR_PGOFF(bar, pgoff) times the page size as the mmap() offset
+ */
+#define BF_MMAP_BAR_PGOFF_BASE  0x100000
+#define BF_MMAP_BAR_PGOFF_SHIFT 24
+#define BF_MMAP_BAR_PGOFF(bar, pgoff) \
+  (BF_MMAP_BAR_PGOFF_BASE + ((bar) << BF_MMAP_BAR_PGOFF_SHIFT) + (pgoff))
+
+/* bind an eventfd to one interrupt vector. The eventfd is signalled every
+ * time the vector fires. A negative fd unbinds the vector. A vector can be
+ * bound by one open file at a time; the binding goes away when that file
+ * is closed.
+ */
+struct bf_intr_eventfd {
+  __u32 vector;
+  __s32 fd;
+};
+
+#define BF_IOCSINTREVENTFD _IOW(BF_IOC_MAGIC, 1, struct bf_intr_eventfd)
+
+/* read() formats, selected per open file by passing one of these as the
+ * argument of BF_IOCSREADFMT.
+ *
+ * BF_READ_FMT_COUNTERS (default): one s32 per vector, holding the vector's
+ * event count if it changed since the last read and 0 otherwise. With
+ * MSI-X this is always BF_READ_MSIX_COUNTERS counters, as it has always
+ * been: zero padded past bf_intr_info.num_vectors, and vectors above it
+ * are only reported by the other formats. With MSI and legacy interrupts,
+ * one counter per vector in use.
+ *
+ * BF_READ_FMT_COUNTERS_ALL: as BF_READ_FMT_COUNTERS, but always exactly
+ * bf_intr_info.num_vectors counters.
+ *
+ * BF_READ_FMT_PENDING: a struct bf_read_pending, followed by one __u32
+ * event count delta for every bit set in it, in ascending vector order.
+ * read() returns the number of bytes filled in.
+ */
+#define BF_READ_FMT_COUNTERS 0
+#define BF_READ_FMT_PENDING  1
+#define BF_READ_FMT_COUNTERS_ALL 2
+
+#define BF_READ_MSIX_COUNTERS 128
+
+#define BF_READ_PENDING_BITS 512
+
+struct bf_read_pending {
+  __u32 pending[BF_READ_PENDING_BITS / 32]; /* bit n: vector n fired */
+};
+
+#define BF_IOCSREADFMT _IO(BF_IOC_MAGIC, 2)
+
+/* DMA buffer allocation. Buffers are allocated on the NUMA node of the
+ * device and mapped for it (through the IOMMU if there is one). size is
+ * rounded up to a power of two number of pages. A buffer lives until it
+ * is freed with BF_IOCDMAFREE (argument: the buffer id) or the file that
+ * allocated it is closed, and after that for as long as it stays mmapped.
+ */
+#define BF_DMA_COHERENT  0 /* uncached/snooped, never needs syncing */
+#define BF_DMA_STREAMING 1 /* cacheable, synced with BF_IOCDMASYNC */
+/* or'ed into the type: the buffer is not freed when the file that
+ * allocated it is closed, so that a restarted user space driver can find
+ * it again with BF_IOCDMAQUERY and mmap it while the device keeps using
+ * it. It is freed with BF_IOCDMAFREE, through any open file, or when the
+ * device goes away. Only BF_IOCDMAALLOC buffers can persist: memory
+ * pinned with BF_IOCDMAPIN is not kept across a restart and cannot be
+ * reused by the next process, which has to pin its own, see BF_IOCDMAPIN.
+ */
+#define BF_DMA_PERSIST   0x100
+
+struct bf_dma_alloc {
+  __u64 size;        /* in: bytes; out: actual size */
+  __u32 type;        /* in: BF_DMA_xxx */
+  __u32 id;          /* out: buffer id */
+  __u64 dma_addr;    /* out: bus address to program into the device */
+  __u64 mmap_offset; /* out: mmap() offset of the buffer */
+};
+
+#define BF_DMA_SYNC_FOR_CPU    0
+#define BF_DMA_SYNC_FOR_DEVICE 1
+
+/* hand a range of a BF_DMA_STREAMING buffer over to the CPU or device */
+struct bf_dma_sync {
+  __u32 id;
+  __u32 dir;         /* BF_DMA_SYNC_xxx */
+  __u64 offset;
+  __u64 len;
+};
+
+#define BF_IOCDMAALLOC _IOWR(BF_IOC_MAGIC, 3, struct bf_dma_alloc)
+#define BF_IOCDMAFREE  _IO(BF_IOC_MAGIC, 4)
+#define BF_IOCDMASYNC  _IOW(BF_IOC_MAGIC, 5, struct bf_dma_sync)
+/* fill in a bf_dma_alloc for the buffer whose id is passed in. Fails with
+ * EOPNOTSUPP for a BF_IOCDMAPIN id.
+ */
+#define BF_IOCDMAQUERY _IOWR(BF_IOC_MAGIC, 18, struct bf_dma_alloc)
+
+/* pin a page aligned user memory range (typically 2M or 1G hugepages) and
+ * map it for the device. The bus address ranges are returned in the segs
+ * array, one entry per physically contiguous chunk. If nsegs is too small
+ * the ioctl fails with ENOSPC before anything is mapped, and nsegs is set
+ * to the number needed; nsegs of at least size / page size always fits. The
+ * range stays pinned until BF_IOCDMAFREE(id) or the file is closed.
+ *
+ * Pinned ranges never persist: the pages belong to the process that
+ * pinned them and are unpinned and unmapped when its file is closed. A
+ * restarted user space driver has to pin its memory again and reprogram
+ * the device with the new bus addresses before restarting DMA; the driver
+ * logs a warning if pinned ranges go away while persistent buffers remain.
+ */
+struct bf_dma_seg {
+  __u64 dma_addr;
+  __u64 len;
+};
+
+struct bf_dma_pin {
+  __u64 uaddr;       /* in: start of the range */
+  __u64 size;        /* in: bytes */
+  __u64 segs;        /* in: user pointer to struct bf_dma_seg[nsegs] */
+  __u32 nsegs;       /* in: size of segs; out: entries filled in */
+  __u32 id;          /* out: id to free the pinning with */
+};
+
+#define BF_IOCDMAPIN   _IOWR(BF_IOC_MAGIC, 6, struct bf_dma_pin)
+
+/* set of interrupt vectors, bit n standing for vector n */
+struct bf_intr_bitmap {
+  __u32 bits[BF_READ_PENDING_BITS / 32];
+};
+
+/* adaptive interrupt moderation (MSI-X only). When a vector fires more
+ * than max_rate times per second, the driver masks it and adds it to the
+ * set returned by BF_IOCGINTRPOLLED. The interrupt that crossed the limit
+ * is still reported, after which user space is expected to poll the
+ * interrupt source until it is drained and then re-arm the vector with
+ * BF_IOCINTRREARM (argument: the vector). write() of the global interrupt
+ * enable does not unmask vectors in polling mode. max_rate 0 turns
+ * moderation off for the vector.
+ */
+struct bf_intr_moderation {
+  __u32 vector;
+  __u32 max_rate;
+};
+
+#define BF_IOCSINTRMOD    _IOW(BF_IOC_MAGIC, 7, struct bf_intr_moderation)
+#define BF_IOCINTRREARM   _IO(BF_IOC_MAGIC, 8)
+#define BF_IOCGINTRPOLLED _IOR(BF_IOC_MAGIC, 9, struct bf_intr_bitmap)
+
+/* mask or unmask a set of vectors (MSI-X only). Only the MSI-X table
+ * entries of the given vectors are written, so re-arming one interrupt
+ * source costs a single MMIO write. Unmasking a vector in polling mode
+ * re-arms it like BF_IOCINTRREARM does.
+ */
+#define BF_INTR_MASK   0
+#define BF_INTR_UNMASK 1
+
+struct bf_intr_mask {
+  __u32 op;          /* BF_INTR_MASK or BF_INTR_UNMASK */
+  struct bf_intr_bitmap vectors;
+};
+
+#define BF_IOCSINTRMASK   _IOW(BF_IOC_MAGIC, 10, struct bf_intr_mask)
+
+/* cpu affinity of a vector. By default (module parameter intr_numa_spread)
+ * the vectors are spread over the cpus of the device's NUMA node.
+ * BF_IOCSINTRAFFINITY pins a vector to a cpu, or with cpu -1 drops its
+ * affinity hint. BF_IOCGINTRAFFINITY also returns the linux irq number of
+ * the vector and the NUMA node of the device (-1 if unknown).
+ */
+struct bf_intr_affinity {
+  __u32 vector;
+  __s32 cpu;
+  __u32 irq;         /* out, BF_IOCGINTRAFFINITY only */
+  __s32 node;        /* out, BF_IOCGINTRAFFINITY only */
+};
+
+#define BF_IOCSINTRAFFINITY _IOW(BF_IOC_MAGIC, 11, struct bf_intr_affinity)
+#define BF_IOCGINTRAFFINITY _IOWR(BF_IOC_MAGIC, 12, struct bf_intr_affinity)
+
+/* BAR mmap() policy. BARs are mapped uncached by default; BF_BAR_MAP_WC
+ * maps them write-combining instead, which speeds up bulk register/table
+ * writes but lets the CPU merge and reorder stores to the BAR: order them
+ * with a store fence where it matters. The policy applies to mappings
+ * made after it is set. BF_IOCGBARATTR also returns the BAR size.
+ */
+#define BF_BAR_MAP_WC 0x1
+
+struct bf_bar_attr {
+  __u32 bar;
+  __u32 flags;       /* BF_BAR_MAP_xxx */
+  __u64 size;        /* out, BF_IOCGBARATTR only */
+};
+
+#define BF_IOCSBARATTR _IOW(BF_IOC_MAGIC, 13, struct bf_bar_attr)
+#define BF_IOCGBARATTR _IOWR(BF_IOC_MAGIC, 14, struct bf_bar_attr)
+
+/* vectors an open file is interested in; all of them by default. read()
+ * and poll() only report, and only wake up for, subscribed vectors, so
+ * several processes can share the device without all waking up on every
+ * interrupt. Events of a vector from before it is subscribed are not
+ * reported.
+ */
+#define BF_IOCSINTRSUBSCRIBE _IOW(BF_IOC_MAGIC, 15, struct bf_intr_bitmap)
+#define BF_IOCGINTRSUBSCRIBE _IOR(BF_IOC_MAGIC, 16, struct bf_intr_bitmap)
+
+/* interrupt setup of the device. The driver asks for every MSI-X vector
+ * the device has (up to BF_READ_PENDING_BITS) and accepts fewer, in which
+ * case num_vectors < max_vectors and user space has to make the device's
+ * interrupt sources share the vectors it got.
+ */
+#define BF_INTR_TYPE_NONE   0
+#define BF_INTR_TYPE_LEGACY 1
+#define BF_INTR_TYPE_MSI    2
+#define BF_INTR_TYPE_MSIX   3
+
+struct bf_intr_info {
+  __u32 type;        /* BF_INTR_TYPE_xxx */
+  __u32 num_vectors; /* vectors in use */
+  __u32 max_vectors; /* vectors the device supports */
+  __u32 reserved;
+};
+
+#define BF_IOCGINTRINFO _IOR(BF_IOC_MAGIC, 17, struct bf_intr_info)
+
+/* copy a list of BAR ranges, back to back, into a user buffer or, if
+ * dma_id is not -1, into a DMA buffer from BF_IOCDMAALLOC (at offset buf).
+ * Ranges are read with wide MMIO accesses and must be 4 byte aligned.
+ * buf_len is updated to the number of bytes copied.
+ */
+#define BF_SNAPSHOT_MAX_RANGES 4096
+
+struct bf_bar_range {
+  __u32 bar;
+  __u32 len;         /* bytes */
+  __u64 offset;      /* bytes into the BAR */
+};
+
+struct bf_bar_snapshot {
+  __u64 ranges;      /* in: user pointer to struct bf_bar_range[nranges] */
+  __u32 nranges;
+  __s32 dma_id;      /* -1: buf is a user pointer */
+  __u64 buf;         /* user pointer, or offset into the DMA buffer */
+  __u64 buf_len;     /* in: room at buf; out: bytes copied */
+};
+
+#define BF_IOCBARSNAPSHOT _IOWR(BF_IOC_MAGIC, 19, struct bf_bar_snapshot)
+
+#endif /* _BF_IOCTL_H_ */
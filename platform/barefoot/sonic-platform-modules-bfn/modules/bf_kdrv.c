@@ -58,6 +58,7 @@
 #include <linux/version.h>
 #include <linux/wait.h>
 #include <linux/poll.h>
+#include <linux/rcupdate.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
   #include <linux/sched/signal.h>
@@ -68,6 +69,24 @@
 #include <linux/cdev.h>
 #include <linux/aer.h>
 #include <linux/string.h>
+#include <linux/eventfd.h>
+#include <linux/dma-mapping.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+
+#include "bf_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "bf_kdrv_trace.h"
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
 //#error unsupported linux kernel version
@@ -97,8 +116,15 @@ extern int pci_enable_msix_range(struct pci_dev *dev, struct msix_entry *entries
 #define BF_INTR_MODE_MSI_NAME "msi"
 #define BF_INTR_MODE_MSIX_NAME "msix"
 #define BF_MAX_BAR_MAPS   6
-#define BF_MSIX_ENTRY_CNT 128 /* TBD  make it 512 */
+#define BF_MSIX_ENTRY_CNT 512 /* max MSI-X vectors used */
 #define BF_MSI_ENTRY_CNT  2
+#define BF_MOD_WINDOW     (HZ / 10) /* interrupt rate sampling period */
+#define BF_DMA_MAX_BUFS   4096
+#define BF_DMA_MAX_ORDER  (MAX_ORDER - 1)
+#define BF_DMA_USER       (-1) /* bf_dma_buf.type of pinned user memory */
+#define BF_DMA_PIN_MAX_PAGES (1 << 22) /* 16GB worth of 4K pages */
+#define BF_LAT_BUCKETS    24 /* log2 latency histogram: <1us ... >=4s */
+#define BF_READ_STACK_CNT BF_READ_MSIX_COUNTERS /* read() snapshot on stack */
 
 /* interrupt mode */
 enum bf_intr_mode {
@@ -114,13 +140,23 @@ struct bf_dev_mem {
   phys_addr_t             addr;
   resource_size_t         size;
   void __iomem            *internal_addr;
+  u32                     map_flags; /* BF_BAR_MAP_xxx for mmap() */
 };
 
 struct bf_listener {
-  struct bf_pci_dev *bfdev;
-  s32 event_count[BF_MSIX_ENTRY_CNT];
+  struct bf_pci_dev *bfdev;     /* NULL once the device is removed */
+  struct bf_pci_dev *bfdev_ref; /* reference held until release */
+  int num_vec;            /* entries of event_count[] */
   int minor;
+  int read_fmt;           /* BF_READ_FMT_xxx */
+  /* vectors that fired since last reported by a BF_READ_FMT_PENDING read */
+  unsigned long pending[BITS_TO_LONGS(BF_MSIX_ENTRY_CNT)];
+  /* vectors this fd reports and wakes up for, see BF_IOCSINTRSUBSCRIBE */
+  unsigned long subscribed[BITS_TO_LONGS(BF_MSIX_ENTRY_CNT)];
+  wait_queue_head_t wait; /* readers and pollers of this fd sleep here */
   struct bf_listener *next;
+  struct rcu_head rcu;
+  s32 event_count[];
 };
 
 /* device information */
@@ -128,8 +164,12 @@ struct bf_dev_info {
   struct module           *owner;
   struct device           *dev;
   int                     minor;
-  atomic_t                event[BF_MSIX_ENTRY_CNT];
-  wait_queue_head_t       wait;
+  atomic_t                *event;   /* per vector counters in a page
+                                       user space may mmap */
+  /* per vector eventfd, signalled from the ISR; protected by efd_lock */
+  struct eventfd_ctx      **efd;
+  struct bf_listener      **efd_owner;
+  spinlock_t              efd_lock;
   const char              *version;
   struct bf_dev_mem       mem[BF_MAX_BAR_MAPS];
   struct msix_entry       *msix_entries;
@@ -139,13 +179,50 @@ struct bf_dev_info {
   int                     pci_error_state; /* was there a pci bus error */
 };
 
+/* DMA buffer handed out to user space through BF_IOCDMAALLOC */
+struct bf_dma_buf {
+  struct kref             ref;      /* idr entry and every mapping */
+  struct device           *dev;     /* holds a reference on the device */
+  struct bf_listener      *owner;   /* open file that allocated it */
+  bool                    persist;  /* survives the close of owner */
+  int                     id;
+  int                     type;     /* BF_DMA_COHERENT, BF_DMA_STREAMING
+                                       or BF_DMA_USER */
+  size_t                  size;
+  void                    *cpu_addr;
+  dma_addr_t              dma_addr;
+  struct page             *pages;   /* BF_DMA_STREAMING only */
+  unsigned int            order;
+  struct sg_table         sgt;      /* BF_DMA_USER only: pinned pages */
+};
+
 /* cookie to be passed to IRQ handler, useful especially with MSIX */
 struct bf_int_vector {
   struct bf_pci_dev *bf_dev;
   int int_vec_offset;
+  struct msi_desc *msi_desc; /* MSI-X table entry of this vector */
+  /* adaptive moderation, see bf_intr_moderate() */
+  int cpu;                   /* affinity hint, -1 if none */
+  u32 mod_limit;             /* max interrupts per BF_MOD_WINDOW, 0: off */
+  u32 mod_cnt;               /* interrupts in the current window */
+  unsigned long mod_window;  /* start of the current window, in jiffies */
 };
 
 
+/* per vector interrupt statistics, shown in debugfs by bf_stats_show().
+ * Updated without locking, so concurrent readers of the same vector may
+ * occasionally lose a sample.
+ */
+struct bf_intr_stats {
+  u64 count;                 /* interrupts since the last reset */
+  u64 injected;              /* of which from the debugfs inject file */
+  u64 irq_ns;                /* time of the last interrupt */
+  u64 rearm_ns;              /* time of the last re-enable, 0 once used */
+  u32 lat_read[BF_LAT_BUCKETS];  /* interrupt to read() return */
+  u32 lat_poll[BF_LAT_BUCKETS];  /* interrupt to poll() return */
+  u32 lat_rearm[BF_LAT_BUCKETS]; /* re-enable to the next interrupt */
+};
+
 /**
  * A structure describing the private information for a BF pcie device.
  */
@@ -153,11 +230,20 @@ struct bf_pci_dev {
 	struct bf_dev_info info;
 	struct pci_dev *pdev;
 	enum   bf_intr_mode mode;
-	u8     instance;
 	char   name[16];
-  struct bf_int_vector bf_int_vec[BF_MSIX_ENTRY_CNT];
+  int    num_vec;                    /* entries of the per vector arrays */
+  struct bf_int_vector *bf_int_vec;
   struct bf_listener *listener_head; /* head of a singly linked list of
                                         listeners */
+  spinlock_t mask_lock;              /* MSI-X entry mask bits */
+  /* vectors masked by moderation, left for user space to poll */
+  unsigned long intr_polled[BITS_TO_LONGS(BF_MSIX_ENTRY_CNT)];
+  struct mutex dma_lock;             /* protects dma_idr */
+  struct idr dma_idr;                /* bf_dma_buf indexed by id */
+  struct bf_intr_stats *stats;       /* num_vec entries */
+  u64 stats_reset_ns;                /* time the stats were last cleared */
+  struct dentry *debugfs_dir;
+  struct kref ref;                   /* probe and every open file */
 };
 
 /* Keep any global information here that must survive even after the
@@ -165,36 +251,66 @@ struct bf_pci_dev {
  */
 struct bf_global {
   struct bf_pci_dev *bfdev ;
-  struct cdev *bf_cdev;
   struct fasync_struct *async_queue;
 };
 
 static int bf_major;
+static struct cdev *bf_cdev; /* covers all BF_MAX_DEVICE_CNT minors */
 static int bf_minor[BF_MAX_DEVICE_CNT] = {0};
 static struct class *bf_class = NULL;
 static char *intr_mode = NULL;
+static bool intr_numa_spread = true;
+static bool warm_recovery = false;
 static enum bf_intr_mode bf_intr_mode_default = BF_INTR_MODE_MSI;
 static spinlock_t bf_nonisr_lock;
+static struct dentry *bf_debugfs_root;
 /* dev->minor should index into this array */
 static struct bf_global bf_global[BF_MAX_DEVICE_CNT];
 
-static void bf_add_listener(struct bf_pci_dev *bfdev,
-                            struct bf_listener *listener)
+static int bf_add_listener(struct bf_pci_dev *bfdev,
+                           struct bf_listener *listener)
 {
   struct bf_listener **cur_listener = &bfdev->listener_head;
 
   if (!listener) {
-    return;
+    return -EINVAL;
   }
   spin_lock(&bf_nonisr_lock);
+  /* the device went away since open() looked it up */
+  if (bf_global[bfdev->info.minor].bfdev != bfdev) {
+    spin_unlock(&bf_nonisr_lock);
+    return -ENODEV;
+  }
 
   while (*cur_listener) {
       cur_listener = &((*cur_listener)->next);
   }
-  *cur_listener = listener;
   listener->next = NULL;
+  /* the listener list is walked under rcu_read_lock() by bf_interrupt() */
+  rcu_assign_pointer(*cur_listener, listener);
 
   spin_unlock(&bf_nonisr_lock);
+  return 0;
+}
+
+/* make the device unreachable from open() and tell the open files that it
+ * is gone. Their listeners keep a reference on bfdev, so a reader still
+ * asleep on it or an ioctl in progress can finish safely.
+ */
+static void bf_detach_listeners(struct bf_pci_dev *bfdev)
+{
+  struct bf_listener *cur_listener;
+
+  spin_lock(&bf_nonisr_lock);
+  bf_global[bfdev->info.minor].bfdev = NULL;
+  cur_listener = bfdev->listener_head;
+  while (cur_listener) {
+    cur_listener->bfdev = NULL;
+    /* kick any reader blocked in bf_read() so that it sees the removal */
+    wake_up_interruptible_all(&cur_listener->wait);
+    cur_listener = cur_listener->next;
+  }
+  spin_unlock(&bf_nonisr_lock);
 }
 
 static void bf_remove_listener(struct bf_pci_dev *bfdev,
@@ -209,22 +325,44 @@ static void bf_remove_listener(struct bf_pci_dev *bfdev,
   }
   spin_lock(&bf_nonisr_lock);
 
+  /* listener->next is left intact so that a concurrent bf_interrupt()
+   * still positioned on this listener can continue its walk; the listener
+   * itself is freed only after an RCU grace period.
+   */
   if (*cur_listener == listener) {
-    *cur_listener = listener->next;
+    rcu_assign_pointer(*cur_listener, listener->next);
   } else {
     while (*cur_listener) {
       if ((*cur_listener)->next == listener) {
-        (*cur_listener)->next = listener->next;
+        rcu_assign_pointer((*cur_listener)->next, listener->next);
         break;
       }
       cur_listener = &((*cur_listener)->next);
     }
-    listener->next = NULL;
   }
 
   spin_unlock(&bf_nonisr_lock);
 }
 
+/* linux irq number of a device interrupt vector, 0 if there is none */
+static unsigned int bf_vector_irq(struct bf_pci_dev *bfdev, int vector)
+{
+  struct bf_dev_info *info = &bfdev->info;
+
+  if (!info->irq || vector < 0)
+    return 0;
+  switch (bfdev->mode) {
+  case BF_INTR_MODE_MSIX:
+    return vector < info->num_irq ? info->msix_entries[vector].vector : 0;
+  case BF_INTR_MODE_MSI:
+    return vector < info->num_irq ? info->irq + vector : 0;
+  case BF_INTR_MODE_LEGACY:
+    return vector == 0 ? info->irq : 0;
+  default:
+    return 0;
+  }
+}
+
 /* a pool of minor numbers is maintained */
 /* return the first available minor number */
 static int bf_get_next_minor_no(int *minor)
@@ -266,6 +404,43 @@ static inline struct bf_pci_dev *bf_get_pci_dev(struct bf_dev_info *info)
 	return container_of(info, struct bf_pci_dev, info);
 }
 
+static inline u64 bf_now_ns(void)
+{
+  return ktime_to_ns(ktime_get());
+}
+
+/* account the time elapsed since start_ns in a log2 histogram of
+ * microseconds: bucket 0 counts < 1us, bucket n counts [2^(n-1), 2^n) us
+ * and the last bucket everything beyond
+ */
+static void bf_lat_record(u32 *hist, u64 start_ns, u64 now_ns)
+{
+  u64 us;
+  int b;
+
+  if (!start_ns || now_ns < start_ns)
+    return;
+  us = div_u64(now_ns - start_ns, NSEC_PER_USEC);
+  b = us ? fls64(us) : 0;
+  hist[min(b, BF_LAT_BUCKETS - 1)]++;
+}
+
+/* the vector is enabled again: start timing the next interrupt */
+static inline void bf_stats_rearm(struct bf_pci_dev *bfdev, int vector,
+                                  u64 now_ns)
+{
+  bfdev->stats[vector].rearm_ns = now_ns;
+}
+
+/* the vector was reported to user space by read() or poll() */
+static inline void bf_stats_deliver(struct bf_pci_dev *bfdev, int vector,
+                                    bool poll, u64 now_ns)
+{
+  struct bf_intr_stats *st = &bfdev->stats[vector];
+
+  bf_lat_record(poll ? st->lat_poll : st->lat_read, st->irq_ns, now_ns);
+}
+
 /*
  * It masks the msix on/off of generating MSI-X messages.
  */
@@ -304,26 +479,84 @@ static int
 bf_pci_irqcontrol(struct bf_pci_dev *bfdev, s32 irq_state)
 {
 	struct pci_dev *pdev = bfdev->pdev;
+	u64 now = bf_now_ns();
+	int i;
 
-	pci_cfg_access_lock(pdev);
-	if (bfdev->mode == BF_INTR_MODE_LEGACY)
-		pci_intx(pdev, !!irq_state);
+	if (irq_state) {
+		for (i = 0; bf_vector_irq(bfdev, i); i++)
+			bf_stats_rearm(bfdev, i, now);
+	}
 
-	else if (bfdev->mode == BF_INTR_MODE_MSIX) {
+	if (bfdev->mode == BF_INTR_MODE_LEGACY) {
+		/* INTx is disabled through the config space command register */
+		pci_cfg_access_lock(pdev);
+		pci_intx(pdev, !!irq_state);
+		pci_cfg_access_unlock(pdev);
+	} else if (bfdev->mode == BF_INTR_MODE_MSIX) {
+		/* MSI-X mask bits live in the memory mapped MSI-X table */
 		struct msi_desc *desc;
+		unsigned long flags;
+
+		spin_lock_irqsave(&bfdev->mask_lock, flags);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
-		list_for_each_entry(desc, &pdev->msi_list, list)
-			bf_msix_mask_irq(desc, irq_state);
+		list_for_each_entry(desc, &pdev->msi_list, list) {
 #else
-		for_each_pci_msi_entry(desc, pdev)
-			bf_msix_mask_irq(desc, irq_state);
+		for_each_pci_msi_entry(desc, pdev) {
 #endif
+			/* vectors in polling mode are re-armed one by one */
+			if (irq_state &&
+			    test_bit(desc->msi_attrib.entry_nr, bfdev->intr_polled))
+				continue;
+			bf_msix_mask_irq(desc, irq_state);
+		}
+		spin_unlock_irqrestore(&bfdev->mask_lock, flags);
 	}
-	pci_cfg_access_unlock(pdev);
 
 	return 0;
 }
 
+/* remember the MSI-X table entry of each vector for per vector masking */
+static void bf_msix_map_descs(struct bf_pci_dev *bfdev)
+{
+	struct pci_dev *pdev = bfdev->pdev;
+	struct msi_desc *desc;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,2,0)
+	list_for_each_entry(desc, &pdev->msi_list, list) {
+#else
+	for_each_pci_msi_entry(desc, pdev) {
+#endif
+		if (desc->msi_attrib.entry_nr < bfdev->num_vec)
+			bfdev->bf_int_vec[desc->msi_attrib.entry_nr].msi_desc = desc;
+	}
+}
+
+/**
+ * adaptive moderation: once a vector fires more than its configured limit
+ * within BF_MOD_WINDOW, mask it and flag it in intr_polled. User space then
+ * polls the interrupt source until it is drained and re-arms the vector
+ * with BF_IOCINTRREARM.
+ */
+static void bf_intr_moderate(struct bf_pci_dev *bfdev,
+                             struct bf_int_vector *vec)
+{
+  unsigned long now = jiffies;
+
+  if (!vec->mod_limit || !vec->msi_desc)
+    return;
+  if (time_after_eq(now, vec->mod_window + BF_MOD_WINDOW)) {
+    vec->mod_window = now;
+    vec->mod_cnt = 0;
+  }
+  if (++vec->mod_cnt <= vec->mod_limit)
+    return;
+
+  spin_lock(&bfdev->mask_lock);
+  bf_msix_mask_irq(vec->msi_desc, 0);
+  set_bit(vec->int_vec_offset, bfdev->intr_polled);
+  spin_unlock(&bfdev->mask_lock);
+}
+
 /**
  * interrupt handler which will check if the interrupt is from the right
  * device. If so, disable it here and will be enabled later.
@@ -405,113 +638,1103 @@ bf_setup_bars(struct pci_dev *dev, struct bf_dev_info *info)
 	return (iom != 0) ? ret : -ENOENT;
 }
 
+/* flag the vector pending and wake up the readers/pollers subscribed to it */
+static void bf_wake_listeners(struct bf_pci_dev *bfdev, int vect_off)
+{
+  struct bf_listener *listener;
+
+  /* order the event counter increment before the pending bits */
+  smp_wmb();
+
+  rcu_read_lock();
+  for (listener = rcu_dereference(bfdev->listener_head); listener;
+       listener = rcu_dereference(listener->next)) {
+    if (!test_bit(vect_off, listener->subscribed))
+      continue;
+    set_bit(vect_off, listener->pending);
+    wake_up_interruptible_poll(&listener->wait, POLLIN | POLLRDNORM);
+  }
+  rcu_read_unlock();
+}
+
+/* report an interrupt of the vector to user space. Called with interrupts
+ * disabled, from bf_interrupt() or from the debugfs inject file. Injected
+ * events leave moderation and the re-arm latency alone: they did not come
+ * from the device, and must not get the real vector masked.
+ */
+static void bf_intr_deliver(struct bf_int_vector *vec, bool injected)
+{
+  struct bf_pci_dev *bfdev = vec->bf_dev;
+  int vect_off = vec->int_vec_offset;
+  struct bf_intr_stats *st = &bfdev->stats[vect_off];
+  u64 now = bf_now_ns();
+
+  st->count++;
+  st->irq_ns = now;
+  if (injected) {
+    st->injected++;
+  } else {
+    if (st->rearm_ns) {
+      bf_lat_record(st->lat_rearm, st->rearm_ns, now);
+      st->rearm_ns = 0;
+    }
+    bf_intr_moderate(bfdev, vec);
+  }
+  trace_bf_interrupt(bfdev->info.minor, vect_off,
+                     atomic_inc_return(&(bfdev->info.event[vect_off])));
+  spin_lock(&bfdev->info.efd_lock);
+  if (bfdev->info.efd[vect_off])
+    eventfd_signal(bfdev->info.efd[vect_off], 1);
+  spin_unlock(&bfdev->info.efd_lock);
+  bf_wake_listeners(bfdev, vect_off);
+}
+
 static irqreturn_t bf_interrupt(int irq, void *bfdev_id)
 {
-  struct bf_pci_dev *bfdev = ((struct bf_int_vector *)bfdev_id)->bf_dev;
-  int vect_off = ((struct bf_int_vector *)bfdev_id)->int_vec_offset;
+  struct bf_pci_dev *bfdev = ((struct bf_int_vector *)bfdev_id)->bf_dev;
+
+  irqreturn_t ret = bf_pci_irqhandler(irq, bfdev);
+
+  if (ret == IRQ_HANDLED)
+    bf_intr_deliver((struct bf_int_vector *)bfdev_id, false);
+
+  return ret;
+}
+
+/* counters a counter format read() returns, see BF_READ_FMT_COUNTERS */
+static int bf_read_counters(struct bf_pci_dev *bfdev,
+                            struct bf_listener *listener)
+{
+  if (bfdev->mode == BF_INTR_MODE_MSIX &&
+      listener->read_fmt == BF_READ_FMT_COUNTERS)
+    return BF_READ_MSIX_COUNTERS;
+  return listener->num_vec;
+}
+
+static unsigned int bf_poll(struct file *filep, poll_table *wait)
+{
+  struct bf_listener *listener = (struct bf_listener *)filep->private_data;
+  struct bf_pci_dev *bfdev = listener->bfdev;
+  int i, n;
+    
+  if (!bfdev) {
+    return -ENODEV;
+  }
+  if (!bfdev->info.irq)
+    return -EIO;
+    
+  poll_wait(filep, &listener->wait, wait);
+
+  if (listener->read_fmt == BF_READ_FMT_PENDING) {
+    n = listener->num_vec;
+    i = find_first_bit(listener->pending, n);
+  } else {
+    /* only the vectors read() would report */
+    n = min(bf_read_counters(bfdev, listener), listener->num_vec);
+    for_each_set_bit(i, listener->subscribed, n)
+      if (listener->event_count[i] != atomic_read(&bfdev->info.event[i]))
+        break;
+  }
+  if (i >= n)
+    return 0;
+
+  bf_stats_deliver(bfdev, i, true, bf_now_ns());
+  trace_bf_poll(listener->minor, i);
+  return POLLIN | POLLRDNORM;
+}
+
+/* decode vm_pgoff into a BAR index and a page offset into that BAR */
+static int bf_find_mem_index(struct vm_area_struct *vma, unsigned long *pgoff)
+{
+  struct bf_pci_dev *bfdev = vma->vm_private_data;
+  unsigned long bar;
+
+  *pgoff = 0;
+  if (vma->vm_pgoff < BF_MAX_BAR_MAPS) {
+    bar = vma->vm_pgoff;
+  } else if (vma->vm_pgoff >= BF_MMAP_BAR_PGOFF_BASE) {
+    bar = (vma->vm_pgoff - BF_MMAP_BAR_PGOFF_BASE) >> BF_MMAP_BAR_PGOFF_SHIFT;
+    *pgoff = (vma->vm_pgoff - BF_MMAP_BAR_PGOFF_BASE) &
+             ((1UL << BF_MMAP_BAR_PGOFF_SHIFT) - 1);
+    if (bar >= BF_MAX_BAR_MAPS)
+      return -1;
+  } else {
+    return -1;
+  }
+  if (bfdev->info.mem[bar].size == 0)
+    return -1;
+  return (int)bar;
+}
+    
+/* map the interrupt event counters read-only into user space */
+static int bf_mmap_event_page(struct bf_pci_dev *bfdev,
+                              struct vm_area_struct *vma)
+{
+  if (vma_pages(vma) != 1)
+    return -EINVAL;
+  if (vma->vm_flags & VM_WRITE)
+    return -EPERM;
+  vma->vm_flags &= ~VM_MAYWRITE;
+
+  /* the mapping holds its own reference on the page, so it stays valid
+   * even if the device is removed while user space still has it mapped
+   */
+  return vm_insert_page(vma, vma->vm_start, virt_to_page(bfdev->info.event));
+}
+
+static const struct vm_operations_struct bf_physical_vm_ops = {
+#ifdef CONFIG_HAVE_IOREMAP_PROT
+  .access = generic_access_phys,
+#endif
+};
+
+static int bf_mmap_physical(struct vm_area_struct *vma)
+{
+  struct bf_pci_dev *bfdev = vma->vm_private_data;
+  unsigned long pgoff;
+  int bar = bf_find_mem_index(vma, &pgoff);
+  struct bf_dev_mem *mem;
+  if (bar < 0)
+    return -EINVAL;
+
+  mem = bfdev->info.mem + bar;
+   
+  if (mem->addr & ~PAGE_MASK)
+    return -ENODEV;
+  if (pgoff >= (mem->size >> PAGE_SHIFT) ||
+      vma->vm_end - vma->vm_start > mem->size - (pgoff << PAGE_SHIFT))
+    return -EINVAL;
+    
+  vma->vm_ops = &bf_physical_vm_ops;
+  if (mem->map_flags & BF_BAR_MAP_WC)
+    vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+  else
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    
+  /*
+   * We cannot use the vm_iomap_memory() helper here,
+   * because vma->vm_pgoff is the map cookie we decoded
+   * above in bf_find_mem_index(), rather than an
+   * actual page offset into the mmap.
+   *
+   * So we do the physical mmap with the page offset
+   * that was encoded in the cookie.
+   */
+ return remap_pfn_range(vma, vma->vm_start, (mem->addr >> PAGE_SHIFT) + pgoff,
+                        vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+static void bf_dma_buf_release(struct kref *ref)
+{
+  struct bf_dma_buf *buf = container_of(ref, struct bf_dma_buf, ref);
+
+  if (buf->type == BF_DMA_COHERENT) {
+    dma_free_coherent(buf->dev, buf->size, buf->cpu_addr, buf->dma_addr);
+  } else if (buf->type == BF_DMA_USER) {
+    struct sg_page_iter piter;
+
+    dma_unmap_sg(buf->dev, buf->sgt.sgl, buf->sgt.orig_nents,
+                 DMA_BIDIRECTIONAL);
+    for_each_sg_page(buf->sgt.sgl, &piter, buf->sgt.orig_nents, 0) {
+      struct page *page = sg_page_iter_page(&piter);
+
+      set_page_dirty_lock(page);
+      put_page(page);
+    }
+    sg_free_table(&buf->sgt);
+  } else {
+    dma_unmap_page(buf->dev, buf->dma_addr, buf->size, DMA_BIDIRECTIONAL);
+    __free_pages(buf->pages, buf->order);
+  }
+  put_device(buf->dev);
+  kfree(buf);
+}
+
+static int bf_dma_alloc(struct bf_pci_dev *bfdev,
+                        struct bf_listener *listener,
+                        struct bf_dma_alloc __user *arg)
+{
+  struct device *dev = &bfdev->pdev->dev;
+  struct bf_dma_alloc req;
+  struct bf_dma_buf *buf;
+  int ret;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (req.size == 0 || req.size > (PAGE_SIZE << BF_DMA_MAX_ORDER))
+    return -EINVAL;
+  if ((req.type & ~BF_DMA_PERSIST) != BF_DMA_COHERENT &&
+      (req.type & ~BF_DMA_PERSIST) != BF_DMA_STREAMING)
+    return -EINVAL;
+
+  buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+  kref_init(&buf->ref);
+  buf->owner = listener;
+  buf->persist = !!(req.type & BF_DMA_PERSIST);
+  buf->type = req.type & ~BF_DMA_PERSIST;
+  buf->order = get_order(req.size);
+  buf->size = PAGE_SIZE << buf->order;
+
+  if (buf->type == BF_DMA_COHERENT) {
+    /* allocated from the device's NUMA node */
+    buf->cpu_addr = dma_alloc_coherent(dev, buf->size, &buf->dma_addr,
+                                       GFP_KERNEL);
+    if (!buf->cpu_addr) {
+      ret = -ENOMEM;
+      goto fail_free;
+    }
+  } else {
+    buf->pages = alloc_pages_node(dev_to_node(dev),
+                                  GFP_KERNEL | __GFP_ZERO | __GFP_COMP,
+                                  buf->order);
+    if (!buf->pages) {
+      ret = -ENOMEM;
+      goto fail_free;
+    }
+    buf->cpu_addr = page_address(buf->pages);
+    buf->dma_addr = dma_map_page(dev, buf->pages, 0, buf->size,
+                                 DMA_BIDIRECTIONAL);
+    if (dma_mapping_error(dev, buf->dma_addr)) {
+      __free_pages(buf->pages, buf->order);
+      ret = -ENOMEM;
+      goto fail_free;
+    }
+  }
+  buf->dev = get_device(dev);
+
+  mutex_lock(&bfdev->dma_lock);
+  ret = idr_alloc(&bfdev->dma_idr, buf, 0, BF_DMA_MAX_BUFS, GFP_KERNEL);
+  mutex_unlock(&bfdev->dma_lock);
+  if (ret < 0) {
+    kref_put(&buf->ref, bf_dma_buf_release);
+    return ret;
+  }
+  buf->id = ret;
+
+  req.size = buf->size;
+  req.id = buf->id;
+  req.dma_addr = buf->dma_addr;
+  req.mmap_offset = (__u64)(BF_MMAP_DMA_PGOFF_BASE + buf->id) << PAGE_SHIFT;
+  if (copy_to_user(arg, &req, sizeof(req))) {
+    mutex_lock(&bfdev->dma_lock);
+    idr_remove(&bfdev->dma_idr, buf->id);
+    mutex_unlock(&bfdev->dma_lock);
+    kref_put(&buf->ref, bf_dma_buf_release);
+    return -EFAULT;
+  }
+  return 0;
+
+fail_free:
+  kfree(buf);
+  return ret;
+}
+
+/* pin a user memory range, typically backed by 2M or 1G hugepages, and map
+ * it for the device. Physically contiguous pages are merged into a single
+ * segment before being mapped, so a hugepage costs one IOMMU mapping.
+ */
+static int bf_dma_pin(struct bf_pci_dev *bfdev,
+                      struct bf_listener *listener,
+                      struct bf_dma_pin __user *arg)
+{
+  struct device *dev = &bfdev->pdev->dev;
+  struct bf_dma_seg __user *useg;
+  struct bf_dma_pin req;
+  struct bf_dma_seg seg;
+  struct bf_dma_buf *buf;
+  struct page **pages;
+  struct scatterlist *sg;
+  int i, nr_pages, pinned, nents, ret;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if ((req.uaddr | req.size) & ~PAGE_MASK)
+    return -EINVAL;
+  if (req.size == 0 || (req.size >> PAGE_SHIFT) > BF_DMA_PIN_MAX_PAGES)
+    return -EINVAL;
+  nr_pages = req.size >> PAGE_SHIFT;
+
+  buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+  kref_init(&buf->ref);
+  buf->owner = listener;
+  buf->type = BF_DMA_USER;
+  buf->size = req.size;
+
+  pages = vmalloc(nr_pages * sizeof(*pages));
+  if (!pages) {
+    kfree(buf);
+    return -ENOMEM;
+  }
+
+  pinned = get_user_pages_fast(req.uaddr, nr_pages, 1, pages);
+  if (pinned != nr_pages) {
+    ret = pinned < 0 ? pinned : -EFAULT;
+    goto fail_unpin;
+  }
+
+  ret = sg_alloc_table_from_pages(&buf->sgt, pages, nr_pages, 0, req.size,
+                                  GFP_KERNEL);
+  if (ret)
+    goto fail_unpin;
+
+  /* the segments only ever merge further once mapped, so the coalesced
+   * page runs bound what user space has to make room for. Check before
+   * mapping anything; nsegs of at least the page count always fits.
+   */
+  if (buf->sgt.orig_nents > req.nsegs) {
+    req.nsegs = buf->sgt.orig_nents;
+    sg_free_table(&buf->sgt);
+    ret = copy_to_user(arg, &req, sizeof(req)) ? -EFAULT : -ENOSPC;
+    goto fail_unpin;
+  }
+
+  nents = dma_map_sg(dev, buf->sgt.sgl, buf->sgt.orig_nents,
+                     DMA_BIDIRECTIONAL);
+  if (nents <= 0) {
+    sg_free_table(&buf->sgt);
+    ret = -ENOMEM;
+    goto fail_unpin;
+  }
+  buf->sgt.nents = nents;
+  /* the sg table holds the page references from here on */
+  vfree(pages);
+  buf->dev = get_device(dev);
+
+  useg = (struct bf_dma_seg __user *)(unsigned long)req.segs;
+  for_each_sg(buf->sgt.sgl, sg, nents, i) {
+    seg.dma_addr = sg_dma_address(sg);
+    seg.len = sg_dma_len(sg);
+    if (copy_to_user(&useg[i], &seg, sizeof(seg))) {
+      kref_put(&buf->ref, bf_dma_buf_release);
+      return -EFAULT;
+    }
+  }
+
+  mutex_lock(&bfdev->dma_lock);
+  ret = idr_alloc(&bfdev->dma_idr, buf, 0, BF_DMA_MAX_BUFS, GFP_KERNEL);
+  mutex_unlock(&bfdev->dma_lock);
+  if (ret < 0) {
+    kref_put(&buf->ref, bf_dma_buf_release);
+    return ret;
+  }
+  buf->id = ret;
+
+  req.nsegs = nents;
+  req.id = buf->id;
+  if (copy_to_user(arg, &req, sizeof(req))) {
+    mutex_lock(&bfdev->dma_lock);
+    idr_remove(&bfdev->dma_idr, buf->id);
+    mutex_unlock(&bfdev->dma_lock);
+    kref_put(&buf->ref, bf_dma_buf_release);
+    return -EFAULT;
+  }
+  return 0;
+
+fail_unpin:
+  for (i = 0; i < pinned; i++)
+    put_page(pages[i]);
+  vfree(pages);
+  kfree(buf);
+  return ret;
+}
+
+/* drop the buffer with the given id, or if id is negative all the
+ * non-persistent buffers allocated by the listener, or all buffers if
+ * listener is NULL too. Persistent buffers can be freed by id through any
+ * open file. Buffers still mapped are released on the last munmap().
+ */
+static int bf_dma_free(struct bf_pci_dev *bfdev,
+                       struct bf_listener *listener, int id)
+{
+  struct bf_dma_buf *buf;
+  int ret = 0, unpinned = 0, persist = 0;
+
+  mutex_lock(&bfdev->dma_lock);
+  if (id >= 0) {
+    buf = idr_find(&bfdev->dma_idr, id);
+    if (!buf) {
+      ret = -EINVAL;
+    } else if (!buf->persist && buf->owner != listener) {
+      ret = -EPERM;
+    } else {
+      idr_remove(&bfdev->dma_idr, id);
+      kref_put(&buf->ref, bf_dma_buf_release);
+    }
+  } else {
+    idr_for_each_entry(&bfdev->dma_idr, buf, id) {
+      if (listener && (buf->persist || buf->owner != listener)) {
+        persist += buf->persist;
+        continue;
+      }
+      unpinned += buf->type == BF_DMA_USER;
+      idr_remove(&bfdev->dma_idr, id);
+      kref_put(&buf->ref, bf_dma_buf_release);
+    }
+  }
+  mutex_unlock(&bfdev->dma_lock);
+  /* persistent buffers left behind mean a restart with the device kept
+   * running; pinned memory cannot be carried over to the next client
+   */
+  if (listener && unpinned && persist)
+    dev_warn(&bfdev->pdev->dev,
+             "%d pinned user range(s) unmapped on close; they do not persist, "
+             "the device must not DMA to them until re-pinned\n", unpinned);
+  return ret;
+}
+
+/* look up a buffer by id, e.g. a persistent one allocated before a restart
+ * of the user space driver
+ */
+static int bf_dma_query(struct bf_pci_dev *bfdev,
+                        struct bf_dma_alloc __user *arg)
+{
+  struct bf_dma_alloc req;
+  struct bf_dma_buf *buf;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+
+  mutex_lock(&bfdev->dma_lock);
+  buf = idr_find(&bfdev->dma_idr, req.id);
+  if (!buf) {
+    mutex_unlock(&bfdev->dma_lock);
+    return -EINVAL;
+  }
+  if (buf->type == BF_DMA_USER) {
+    /* pinned user memory does not persist, nothing to query */
+    mutex_unlock(&bfdev->dma_lock);
+    return -EOPNOTSUPP;
+  }
+  req.size = buf->size;
+  req.type = buf->type | (buf->persist ? BF_DMA_PERSIST : 0);
+  req.dma_addr = buf->dma_addr;
+  req.mmap_offset = (__u64)(BF_MMAP_DMA_PGOFF_BASE + buf->id) << PAGE_SHIFT;
+  mutex_unlock(&bfdev->dma_lock);
+  return copy_to_user(arg, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+static int bf_dma_sync(struct bf_pci_dev *bfdev,
+                       struct bf_dma_sync __user *arg)
+{
+  struct bf_dma_sync req;
+  struct bf_dma_buf *buf;
+  int ret = 0;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+
+  mutex_lock(&bfdev->dma_lock);
+  buf = idr_find(&bfdev->dma_idr, req.id);
+  if (!buf || buf->type != BF_DMA_STREAMING ||
+      req.offset >= buf->size || req.len > buf->size - req.offset) {
+    ret = -EINVAL;
+  } else if (req.dir == BF_DMA_SYNC_FOR_CPU) {
+    dma_sync_single_for_cpu(buf->dev, buf->dma_addr + req.offset, req.len,
+                            DMA_BIDIRECTIONAL);
+  } else if (req.dir == BF_DMA_SYNC_FOR_DEVICE) {
+    dma_sync_single_for_device(buf->dev, buf->dma_addr + req.offset,
+                               req.len, DMA_BIDIRECTIONAL);
+  } else {
+    ret = -EINVAL;
+  }
+  mutex_unlock(&bfdev->dma_lock);
+  return ret;
+}
+
+static void bf_dma_vm_open(struct vm_area_struct *vma)
+{
+  struct bf_dma_buf *buf = vma->vm_private_data;
+
+  kref_get(&buf->ref);
+}
+
+static void bf_dma_vm_close(struct vm_area_struct *vma)
+{
+  struct bf_dma_buf *buf = vma->vm_private_data;
+
+  kref_put(&buf->ref, bf_dma_buf_release);
+}
+
+static const struct vm_operations_struct bf_dma_vm_ops = {
+  .open = bf_dma_vm_open,
+  .close = bf_dma_vm_close,
+};
+
+static int bf_mmap_dma(struct bf_pci_dev *bfdev, struct vm_area_struct *vma)
+{
+  struct bf_dma_buf *buf;
+  int ret;
+
+  mutex_lock(&bfdev->dma_lock);
+  buf = idr_find(&bfdev->dma_idr, vma->vm_pgoff - BF_MMAP_DMA_PGOFF_BASE);
+  if (!buf) {
+    mutex_unlock(&bfdev->dma_lock);
+    return -EINVAL;
+  }
+  kref_get(&buf->ref);
+  mutex_unlock(&bfdev->dma_lock);
+
+  ret = -EINVAL;
+  /* pinned user memory is mapped already */
+  if (buf->type == BF_DMA_USER)
+    goto fail_put;
+  if (vma->vm_end - vma->vm_start > buf->size)
+    goto fail_put;
+
+  /* like the BARs, vm_pgoff only selects the buffer; always map it from
+   * its start
+   */
+  vma->vm_pgoff = 0;
+  if (buf->type == BF_DMA_COHERENT) {
+    ret = dma_mmap_coherent(buf->dev, vma, buf->cpu_addr, buf->dma_addr,
+                            buf->size);
+  } else {
+    ret = remap_pfn_range(vma, vma->vm_start, page_to_pfn(buf->pages),
+                          vma->vm_end - vma->vm_start, vma->vm_page_prot);
+  }
+  if (ret)
+    goto fail_put;
+
+  /* the reference taken above now belongs to the mapping */
+  vma->vm_private_data = buf;
+  vma->vm_ops = &bf_dma_vm_ops;
+  return 0;
+
+fail_put:
+  kref_put(&buf->ref, bf_dma_buf_release);
+  return ret;
+}
+
+static int bf_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+  struct bf_listener *listener = filep->private_data;
+  struct bf_pci_dev *bfdev = listener->bfdev;
+  int bar;
+  unsigned long requested_pages, actual_pages, pgoff;
+   
+  if (!bfdev) {
+    return -ENODEV;
+  }
+  if (vma->vm_end < vma->vm_start)
+    return -EINVAL;
+    
+  vma->vm_private_data = bfdev;
+
+  if (vma->vm_pgoff == BF_MMAP_EVENT_PGOFF)
+    return bf_mmap_event_page(bfdev, vma);
+  if (vma->vm_pgoff >= BF_MMAP_DMA_PGOFF_BASE &&
+      vma->vm_pgoff < BF_MMAP_DMA_PGOFF_BASE + BF_DMA_MAX_BUFS)
+    return bf_mmap_dma(bfdev, vma);
+    
+  bar = bf_find_mem_index(vma, &pgoff);
+  if (bar < 0)
+    return -EINVAL;
+    
+  requested_pages = vma_pages(vma);
+  actual_pages = ((bfdev->info.mem[bar].addr & ~PAGE_MASK)
+                   + bfdev->info.mem[bar].size + PAGE_SIZE -1) >> PAGE_SHIFT;
+  if (pgoff >= actual_pages || requested_pages > actual_pages - pgoff)
+    return -EINVAL;
+    
+  return bf_mmap_physical(vma);
+}
+
+/* unbind the eventfds bound by the given listener, or all of them if
+ * listener is NULL
+ */
+static void bf_release_intr_eventfds(struct bf_pci_dev *bfdev,
+                                     struct bf_listener *listener)
+{
+  struct eventfd_ctx *ctx;
+  unsigned long flags;
+  int i;
+
+  for (i = 0; i < bfdev->num_vec; i++) {
+    spin_lock_irqsave(&bfdev->info.efd_lock, flags);
+    ctx = bfdev->info.efd[i];
+    if (ctx && (!listener || bfdev->info.efd_owner[i] == listener)) {
+      bfdev->info.efd[i] = NULL;
+      bfdev->info.efd_owner[i] = NULL;
+    } else {
+      ctx = NULL;
+    }
+    spin_unlock_irqrestore(&bfdev->info.efd_lock, flags);
+    if (ctx)
+      eventfd_ctx_put(ctx);
+  }
+}
+
+static int bf_set_intr_eventfd(struct bf_pci_dev *bfdev,
+                               struct bf_listener *listener,
+                               struct bf_intr_eventfd __user *arg)
+{
+  struct bf_intr_eventfd req;
+  struct eventfd_ctx *ctx = NULL, *old;
+  unsigned long flags;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (req.vector >= bfdev->num_vec)
+    return -EINVAL;
+
+  if (req.fd >= 0) {
+    ctx = eventfd_ctx_fdget(req.fd);
+    if (IS_ERR(ctx))
+      return PTR_ERR(ctx);
+  }
+
+  spin_lock_irqsave(&bfdev->info.efd_lock, flags);
+  old = bfdev->info.efd[req.vector];
+  if (old && bfdev->info.efd_owner[req.vector] != listener) {
+    /* bound through another open file */
+    spin_unlock_irqrestore(&bfdev->info.efd_lock, flags);
+    if (ctx)
+      eventfd_ctx_put(ctx);
+    return -EBUSY;
+  }
+  bfdev->info.efd[req.vector] = ctx;
+  bfdev->info.efd_owner[req.vector] = ctx ? listener : NULL;
+  spin_unlock_irqrestore(&bfdev->info.efd_lock, flags);
+
+  if (old)
+    eventfd_ctx_put(old);
+  return 0;
+}
+
+static int bf_set_read_fmt(struct bf_pci_dev *bfdev,
+                           struct bf_listener *listener, unsigned long fmt)
+{
+  int i;
+
+  switch (fmt) {
+  case BF_READ_FMT_COUNTERS:
+  case BF_READ_FMT_COUNTERS_ALL:
+    break;
+  case BF_READ_FMT_PENDING:
+    /* carry over whatever the counter format had not reported yet */
+    for_each_set_bit(i, listener->subscribed, listener->num_vec) {
+      if (listener->event_count[i] != atomic_read(&bfdev->info.event[i]))
+        set_bit(i, listener->pending);
+    }
+    break;
+  default:
+    return -EINVAL;
+  }
+  listener->read_fmt = fmt;
+  return 0;
+}
+
+static int bf_set_intr_moderation(struct bf_pci_dev *bfdev,
+                                  struct bf_intr_moderation __user *arg)
+{
+  struct bf_intr_moderation req;
+  struct bf_int_vector *vec;
+  u64 limit;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (bfdev->mode != BF_INTR_MODE_MSIX)
+    return -EOPNOTSUPP;
+  if (req.vector >= bfdev->num_vec)
+    return -EINVAL;
+  vec = &bfdev->bf_int_vec[req.vector];
+  if (!vec->msi_desc)
+    return -EINVAL;
+
+  /* convert interrupts per second to interrupts per window */
+  limit = 0;
+  if (req.max_rate) {
+    limit = div_u64((u64)req.max_rate * BF_MOD_WINDOW, HZ);
+    limit = clamp_t(u64, limit, 1, U32_MAX);
+  }
+  vec->mod_limit = (u32)limit;
+  return 0;
+}
+
+/* mask (state 0) or unmask one vector, touching only its MSI-X table
+ * entry. Unmasking also takes the vector out of polling mode and restarts
+ * its rate window. Called with mask_lock held.
+ */
+static void bf_msix_vector_mask(struct bf_pci_dev *bfdev, int vector,
+                                s32 state)
+{
+  struct bf_int_vector *vec = &bfdev->bf_int_vec[vector];
+
+  if (state) {
+    clear_bit(vector, bfdev->intr_polled);
+    vec->mod_cnt = 0;
+    vec->mod_window = jiffies;
+    bf_stats_rearm(bfdev, vector, bf_now_ns());
+  }
+  bf_msix_mask_irq(vec->msi_desc, state);
+}
+
+/* leave polling mode: unmask the vector and restart its rate window */
+static int bf_intr_rearm(struct bf_pci_dev *bfdev, unsigned long vector)
+{
+  unsigned long flags;
+
+  if (bfdev->mode != BF_INTR_MODE_MSIX)
+    return -EOPNOTSUPP;
+  if (vector >= bfdev->num_vec || !bfdev->bf_int_vec[vector].msi_desc)
+    return -EINVAL;
+
+  spin_lock_irqsave(&bfdev->mask_lock, flags);
+  if (test_bit(vector, bfdev->intr_polled))
+    bf_msix_vector_mask(bfdev, vector, 1);
+  spin_unlock_irqrestore(&bfdev->mask_lock, flags);
+  return 0;
+}
+
+/* mask or unmask the set of vectors given as a bitmap */
+static int bf_set_intr_mask(struct bf_pci_dev *bfdev,
+                            struct bf_intr_mask __user *arg)
+{
+  struct bf_intr_mask req;
+  unsigned long flags;
+  int i;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (bfdev->mode != BF_INTR_MODE_MSIX)
+    return -EOPNOTSUPP;
+  if (req.op != BF_INTR_MASK && req.op != BF_INTR_UNMASK)
+    return -EINVAL;
+
+  /* validate the whole set first so that it is applied all or nothing */
+  for (i = 0; i < BF_READ_PENDING_BITS; i++) {
+    if (!(req.vectors.bits[i / 32] & (1U << (i % 32))))
+      continue;
+    if (i >= bfdev->num_vec || !bfdev->bf_int_vec[i].msi_desc)
+      return -EINVAL;
+  }
+
+  spin_lock_irqsave(&bfdev->mask_lock, flags);
+  for (i = 0; i < bfdev->num_vec; i++) {
+    if (req.vectors.bits[i / 32] & (1U << (i % 32)))
+      bf_msix_vector_mask(bfdev, i, req.op == BF_INTR_UNMASK);
+  }
+  spin_unlock_irqrestore(&bfdev->mask_lock, flags);
+  return 0;
+}
+
+static int bf_set_intr_subscribe(struct bf_pci_dev *bfdev,
+                                 struct bf_listener *listener,
+                                 struct bf_intr_bitmap __user *arg)
+{
+  struct bf_intr_bitmap map;
+  int i;
+
+  if (copy_from_user(&map, arg, sizeof(map)))
+    return -EFAULT;
+  for (i = listener->num_vec; i < BF_READ_PENDING_BITS; i++) {
+    if (map.bits[i / 32] & (1U << (i % 32)))
+      return -EINVAL;
+  }
+
+  for (i = 0; i < listener->num_vec; i++) {
+    if (!(map.bits[i / 32] & (1U << (i % 32)))) {
+      clear_bit(i, listener->subscribed);
+      clear_bit(i, listener->pending);
+    } else if (!test_bit(i, listener->subscribed)) {
+      /* only report what fires from now on */
+      listener->event_count[i] = atomic_read(&bfdev->info.event[i]);
+      set_bit(i, listener->subscribed);
+    }
+  }
+  return 0;
+}
+
+static int bf_get_intr_info(struct bf_pci_dev *bfdev,
+                            struct bf_intr_info __user *arg)
+{
+  struct bf_intr_info req;
+
+  BUILD_BUG_ON(BF_INTR_MODE_NONE != BF_INTR_TYPE_NONE ||
+               BF_INTR_MODE_LEGACY != BF_INTR_TYPE_LEGACY ||
+               BF_INTR_MODE_MSI != BF_INTR_TYPE_MSI ||
+               BF_INTR_MODE_MSIX != BF_INTR_TYPE_MSIX);
+  memset(&req, 0, sizeof(req));
+  req.type = bfdev->mode;
+  req.num_vectors = bfdev->mode == BF_INTR_MODE_NONE ? 0 : bfdev->num_vec;
+  if (bfdev->mode == BF_INTR_MODE_MSIX)
+    req.max_vectors = pci_msix_vec_count(bfdev->pdev);
+  else
+    req.max_vectors = req.num_vectors;
+  return copy_to_user(arg, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+/* copy a kernel vector bitmap out in the bf_intr_bitmap layout */
+static int bf_put_intr_bitmap(const unsigned long *bits,
+                              struct bf_intr_bitmap __user *arg)
+{
+  struct bf_intr_bitmap map;
+  int i;
+
+  memset(&map, 0, sizeof(map));
+  for_each_set_bit(i, bits, BF_MSIX_ENTRY_CNT)
+    map.bits[i / 32] |= 1U << (i % 32);
+  return copy_to_user(arg, &map, sizeof(map)) ? -EFAULT : 0;
+}
+
+/* set (cpu >= 0) or clear the affinity hint of a vector */
+static int bf_set_vector_affinity(struct bf_pci_dev *bfdev, int vector,
+                                  int cpu)
+{
+  unsigned int irq = bf_vector_irq(bfdev, vector);
+  int ret;
+
+  if (!irq)
+    return -EINVAL;
+  if (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu)))
+    return -EINVAL;
+
+  /* the hint is applied by the kernel on recent versions and by irqbalance
+   * (--hintpolicy=exact) on older ones
+   */
+  ret = irq_set_affinity_hint(irq, cpu >= 0 ? cpumask_of(cpu) : NULL);
+  if (ret)
+    return ret;
+  bfdev->bf_int_vec[vector].cpu = cpu;
+  return 0;
+}
+
+/* spread the vectors round robin over the online cpus of the device's NUMA
+ * node, so that they do not all land on one core of possibly the wrong
+ * socket
+ */
+static void bf_spread_irq_affinity(struct bf_pci_dev *bfdev)
+{
+  int node = dev_to_node(&bfdev->pdev->dev);
+  const struct cpumask *mask = cpu_online_mask;
+  int i, cpu = -1;
+
+  if (node != NUMA_NO_NODE && cpumask_intersects(cpumask_of_node(node),
+                                                 cpu_online_mask))
+    mask = cpumask_of_node(node);
+
+  for (i = 0; bf_vector_irq(bfdev, i); i++) {
+    do {
+      cpu = cpumask_next(cpu, mask);
+      if (cpu >= nr_cpu_ids)
+        cpu = cpumask_first(mask);
+    } while (!cpu_online(cpu));
+    bf_set_vector_affinity(bfdev, i, cpu);
+  }
+}
+
+static int bf_set_intr_affinity(struct bf_pci_dev *bfdev,
+                                struct bf_intr_affinity __user *arg)
+{
+  struct bf_intr_affinity req;
 
-  irqreturn_t ret = bf_pci_irqhandler(irq, bfdev);
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (req.vector > INT_MAX)
+    return -EINVAL;
+  return bf_set_vector_affinity(bfdev, req.vector, req.cpu);
+}
 
-  if (ret == IRQ_HANDLED)
-    atomic_inc(&(bfdev->info.event[vect_off]));
+static int bf_get_intr_affinity(struct bf_pci_dev *bfdev,
+                                struct bf_intr_affinity __user *arg)
+{
+  struct bf_intr_affinity req;
+  unsigned int irq;
 
-  return ret;
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (req.vector > INT_MAX)
+    return -EINVAL;
+  irq = bf_vector_irq(bfdev, req.vector);
+  if (!irq)
+    return -EINVAL;
+  req.cpu = bfdev->bf_int_vec[req.vector].cpu;
+  req.irq = irq;
+  req.node = dev_to_node(&bfdev->pdev->dev);
+  return copy_to_user(arg, &req, sizeof(req)) ? -EFAULT : 0;
 }
 
-static unsigned int bf_poll(struct file *filep, poll_table *wait)
+/* BAR mmap policy, applies to mappings made after it is set */
+static int bf_set_bar_attr(struct bf_pci_dev *bfdev,
+                           struct bf_bar_attr __user *arg)
 {
-  struct bf_listener *listener = (struct bf_listener *)filep->private_data;
-  struct bf_pci_dev *bfdev = listener->bfdev;
-  int i;
-    
-  if (!bfdev) {
-    return -ENODEV;
-  }
-  if (!bfdev->info.irq)
-    return -EIO;
-    
-  poll_wait(filep, &bfdev->info.wait, wait);
+  struct bf_bar_attr req;
 
-  for (i = 0; i < BF_MSIX_ENTRY_CNT; i++)
-    if (listener->event_count[i] != atomic_read(&bfdev->info.event[i]))
-      return POLLIN | POLLRDNORM;
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (req.bar >= BF_MAX_BAR_MAPS || bfdev->info.mem[req.bar].size == 0)
+    return -EINVAL;
+  if (req.flags & ~BF_BAR_MAP_WC)
+    return -EINVAL;
+  bfdev->info.mem[req.bar].map_flags = req.flags;
   return 0;
 }
 
-static int bf_find_mem_index(struct vm_area_struct *vma)
+static int bf_get_bar_attr(struct bf_pci_dev *bfdev,
+                           struct bf_bar_attr __user *arg)
 {
-  struct bf_pci_dev *bfdev = vma->vm_private_data;
-  if (vma->vm_pgoff < BF_MAX_BAR_MAPS) {
-    if (bfdev->info.mem[vma->vm_pgoff].size == 0)
-      return -1;
-    return (int)vma->vm_pgoff;
-  }
-  return -1;
+  struct bf_bar_attr req;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (req.bar >= BF_MAX_BAR_MAPS || bfdev->info.mem[req.bar].size == 0)
+    return -EINVAL;
+  req.flags = bfdev->info.mem[req.bar].map_flags;
+  req.size = bfdev->info.mem[req.bar].size;
+  return copy_to_user(arg, &req, sizeof(req)) ? -EFAULT : 0;
 }
-    
-static const struct vm_operations_struct bf_physical_vm_ops = {
-#ifdef CONFIG_HAVE_IOREMAP_PROT
-  .access = generic_access_phys,
-#endif
-};
 
-static int bf_mmap_physical(struct vm_area_struct *vma)
+/* copy BAR ranges out for register dumps. The reads go through a bounce
+ * page when the destination is user memory, and the cpu is given up
+ * between pages so that a large dump does not hog it.
+ */
+static int bf_bar_snapshot(struct bf_pci_dev *bfdev,
+                           struct bf_bar_snapshot __user *arg)
 {
-  struct bf_pci_dev *bfdev = vma->vm_private_data;
-  int bar = bf_find_mem_index(vma);
+  struct bf_bar_range __user *uranges;
+  struct bf_bar_snapshot req;
+  struct bf_bar_range range;
+  struct bf_dma_buf *dbuf = NULL;
   struct bf_dev_mem *mem;
-  if (bar < 0)
+  void *bounce = NULL;
+  u64 done = 0;
+  u32 i, chunk, off;
+  int ret = 0;
+
+  if (copy_from_user(&req, arg, sizeof(req)))
+    return -EFAULT;
+  if (req.nranges == 0 || req.nranges > BF_SNAPSHOT_MAX_RANGES)
     return -EINVAL;
 
-  mem = bfdev->info.mem + bar;
-   
-  if (mem->addr & ~PAGE_MASK)
-    return -ENODEV;
-  if (vma->vm_end - vma->vm_start > mem->size)
+  if (req.dma_id >= 0) {
+    mutex_lock(&bfdev->dma_lock);
+    dbuf = idr_find(&bfdev->dma_idr, req.dma_id);
+    if (dbuf && dbuf->type != BF_DMA_USER)
+      kref_get(&dbuf->ref);
+    else
+      dbuf = NULL;
+    mutex_unlock(&bfdev->dma_lock);
+    if (!dbuf)
+      return -EINVAL;
+    if (req.buf > dbuf->size || req.buf_len > dbuf->size - req.buf) {
+      ret = -EINVAL;
+      goto out;
+    }
+  } else if (req.dma_id == -1) {
+    bounce = (void *)__get_free_page(GFP_KERNEL);
+    if (!bounce)
+      return -ENOMEM;
+  } else {
     return -EINVAL;
-    
-  vma->vm_ops = &bf_physical_vm_ops;
-    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-    
-  /*
-   * We cannot use the vm_iomap_memory() helper here,
-   * because vma->vm_pgoff is the map index we looked
-   * up above in bf_find_mem_index(), rather than an
-   * actual page offset into the mmap.
-   *
-   * So we just do the physical mmap without a page
-   * offset.
-   */
- return remap_pfn_range(vma, vma->vm_start, mem->addr >> PAGE_SHIFT,
-                        vma->vm_end - vma->vm_start, vma->vm_page_prot);
+  }
+
+  uranges = (struct bf_bar_range __user *)(unsigned long)req.ranges;
+  for (i = 0; i < req.nranges; i++) {
+    if (copy_from_user(&range, &uranges[i], sizeof(range))) {
+      ret = -EFAULT;
+      goto out;
+    }
+    if (range.bar >= BF_MAX_BAR_MAPS) {
+      ret = -EINVAL;
+      goto out;
+    }
+    mem = &bfdev->info.mem[range.bar];
+    if (!mem->internal_addr || ((range.offset | range.len) & 3) ||
+        range.offset > mem->size || range.len > mem->size - range.offset ||
+        range.len > req.buf_len - done) {
+      ret = -EINVAL;
+      goto out;
+    }
+
+    for (off = 0; off < range.len; off += chunk) {
+      const void __iomem *src = mem->internal_addr + range.offset + off;
+
+      chunk = min_t(u32, range.len - off, PAGE_SIZE);
+      if (dbuf) {
+        memcpy_fromio(dbuf->cpu_addr + req.buf + done, src, chunk);
+      } else {
+        memcpy_fromio(bounce, src, chunk);
+        if (copy_to_user((void __user *)(unsigned long)(req.buf + done),
+                         bounce, chunk)) {
+          ret = -EFAULT;
+          goto out;
+        }
+      }
+      done += chunk;
+      cond_resched();
+    }
+  }
+
+  req.buf_len = done;
+  if (copy_to_user(arg, &req, sizeof(req)))
+    ret = -EFAULT;
+
+out:
+  if (dbuf)
+    kref_put(&dbuf->ref, bf_dma_buf_release);
+  if (bounce)
+    free_page((unsigned long)bounce);
+  return ret;
 }
 
-static int bf_mmap(struct file *filep, struct vm_area_struct *vma)
+static long bf_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 {
   struct bf_listener *listener = filep->private_data;
   struct bf_pci_dev *bfdev = listener->bfdev;
-  int bar;
-  unsigned long requested_pages, actual_pages;
-   
+  void __user *argp = (void __user *)arg;
+
   if (!bfdev) {
     return -ENODEV;
   }
-  if (vma->vm_end < vma->vm_start)
-    return -EINVAL;
-    
-  vma->vm_private_data = bfdev;
-    
-  bar = bf_find_mem_index(vma);
-  if (bar < 0)
-    return -EINVAL;
-    
-  requested_pages = vma_pages(vma);
-  actual_pages = ((bfdev->info.mem[bar].addr & ~PAGE_MASK)
-                   + bfdev->info.mem[bar].size + PAGE_SIZE -1) >> PAGE_SHIFT;
-  if (requested_pages > actual_pages)
-    return -EINVAL;
-    
-  return bf_mmap_physical(vma);
+
+  switch (cmd) {
+  case BF_IOCSINTREVENTFD:
+    return bf_set_intr_eventfd(bfdev, listener, argp);
+  case BF_IOCSREADFMT:
+    return bf_set_read_fmt(bfdev, listener, arg);
+  case BF_IOCDMAALLOC:
+    return bf_dma_alloc(bfdev, listener, argp);
+  case BF_IOCDMAFREE:
+    if (arg >= BF_DMA_MAX_BUFS)
+      return -EINVAL;
+    return bf_dma_free(bfdev, listener, (int)arg);
+  case BF_IOCDMASYNC:
+    return bf_dma_sync(bfdev, argp);
+  case BF_IOCDMAPIN:
+    return bf_dma_pin(bfdev, listener, argp);
+  case BF_IOCDMAQUERY:
+    return bf_dma_query(bfdev, argp);
+  case BF_IOCSINTRMOD:
+    return bf_set_intr_moderation(bfdev, argp);
+  case BF_IOCINTRREARM:
+    return bf_intr_rearm(bfdev, arg);
+  case BF_IOCGINTRPOLLED:
+    return bf_put_intr_bitmap(bfdev->intr_polled, argp);
+  case BF_IOCSINTRMASK:
+    return bf_set_intr_mask(bfdev, argp);
+  case BF_IOCSINTRAFFINITY:
+    return bf_set_intr_affinity(bfdev, argp);
+  case BF_IOCGINTRAFFINITY:
+    return bf_get_intr_affinity(bfdev, argp);
+  case BF_IOCSBARATTR:
+    return bf_set_bar_attr(bfdev, argp);
+  case BF_IOCGBARATTR:
+    return bf_get_bar_attr(bfdev, argp);
+  case BF_IOCSINTRSUBSCRIBE:
+    return bf_set_intr_subscribe(bfdev, listener, argp);
+  case BF_IOCGINTRSUBSCRIBE:
+    return bf_put_intr_bitmap(listener->subscribed, argp);
+  case BF_IOCGINTRINFO:
+    return bf_get_intr_info(bfdev, argp);
+  case BF_IOCBARSNAPSHOT:
+    return bf_bar_snapshot(bfdev, argp);
+  default:
+    return -ENOTTY;
+  }
 }
 
 static int bf_fasync(int fd, struct file *filep, int mode)
@@ -531,24 +1754,68 @@ static int bf_fasync(int fd, struct file *filep, int mode)
   return (fasync_helper(fd, filep, mode, &bf_global[minor].async_queue));
 }
 
+static void bf_free_vectors(struct bf_pci_dev *bfdev)
+{
+  vfree(bfdev->stats);
+  bfdev->stats = NULL;
+  kfree(bfdev->info.efd_owner);
+  bfdev->info.efd_owner = NULL;
+  kfree(bfdev->info.efd);
+  bfdev->info.efd = NULL;
+  kfree(bfdev->bf_int_vec);
+  bfdev->bf_int_vec = NULL;
+}
+
+/* last reference gone: device removed (or probe failed) and all the files
+ * that had it open released
+ */
+static void bf_pci_dev_release(struct kref *ref)
+{
+  struct bf_pci_dev *bfdev = container_of(ref, struct bf_pci_dev, ref);
+
+  bf_free_vectors(bfdev);
+  free_page((unsigned long)bfdev->info.event);
+  kfree(bfdev);
+}
+
 static int bf_open(struct inode *inode, struct file *filep)
 {
   struct bf_pci_dev *bfdev;
   struct bf_listener *listener;
   int i;
 
+  spin_lock(&bf_nonisr_lock);
   bfdev = bf_global[iminor(inode)].bfdev;
-  listener = kmalloc(sizeof(*listener), GFP_KERNEL);
+  if (bfdev)
+    kref_get(&bfdev->ref);
+  spin_unlock(&bf_nonisr_lock);
+  if (!bfdev)
+    return -ENODEV;
+  listener = kmalloc(sizeof(*listener) +
+                     bfdev->num_vec * sizeof(listener->event_count[0]),
+                     GFP_KERNEL);
   if (listener) {
     listener->bfdev = bfdev;
+    listener->bfdev_ref = bfdev;
+    listener->num_vec = bfdev->num_vec;
     listener->minor = bfdev->info.minor;
     listener->next =  NULL;
-    bf_add_listener(bfdev, listener);
-    for (i = 0; i < BF_MSIX_ENTRY_CNT; i++)
+    listener->read_fmt = BF_READ_FMT_COUNTERS;
+    bitmap_zero(listener->pending, BF_MSIX_ENTRY_CNT);
+    bitmap_zero(listener->subscribed, BF_MSIX_ENTRY_CNT);
+    bitmap_set(listener->subscribed, 0, bfdev->num_vec);
+    init_waitqueue_head(&listener->wait);
+    for (i = 0; i < bfdev->num_vec; i++)
       listener->event_count[i] = atomic_read(&bfdev->info.event[i]);
+    if (bf_add_listener(bfdev, listener)) {
+      kfree(listener);
+      kref_put(&bfdev->ref, bf_pci_dev_release);
+      return -ENODEV;
+    }
     filep->private_data = listener;
     return 0;
   } else {
+    kref_put(&bfdev->ref, bf_pci_dev_release);
     return(-ENOMEM);
   }
 }
@@ -559,21 +1826,71 @@ static int bf_release(struct inode *inode, struct file *filep)
 
   bf_fasync(-1, filep, 0); /* empty any process id in the notification list */
   if (listener->bfdev) {
+    bf_release_intr_eventfds(listener->bfdev, listener);
+    bf_dma_free(listener->bfdev, listener, -1);
     bf_remove_listener(listener->bfdev, listener);
   }
-  kfree(listener);
+  kref_put(&listener->bfdev_ref->ref, bf_pci_dev_release);
+  /* bf_interrupt() may still be looking at this listener */
+  kfree_rcu(listener, rcu);
   return 0;
 }
 
+/* BF_READ_FMT_PENDING read: report the pending vectors as a bitmap
+ * followed by the event count delta of each of them. Vectors that do not
+ * fit in the user buffer stay pending for the next read. Returns 0 if
+ * nothing was reported.
+ */
+static ssize_t bf_read_pending(struct bf_listener *listener,
+                               struct bf_pci_dev *bfdev,
+                               char __user *buf, size_t count)
+{
+  struct bf_read_pending hdr;
+  size_t off = sizeof(hdr);
+  u64 now = bf_now_ns();
+  s32 event_count;
+  u32 delta;
+  int i;
+
+  memset(&hdr, 0, sizeof(hdr));
+  for_each_set_bit(i, listener->pending, listener->num_vec) {
+    if (off + sizeof(delta) > count)
+      break;
+    /* clear before sampling the counter; an interrupt racing with us will
+     * set the bit again and at worst show up as a zero delta next time
+     */
+    if (!test_and_clear_bit(i, listener->pending))
+      continue;
+    event_count = atomic_read(&bfdev->info.event[i]);
+    delta = event_count - listener->event_count[i];
+    listener->event_count[i] = event_count;
+    if (!delta)
+      continue;
+    if (copy_to_user(buf + off, &delta, sizeof(delta)))
+      return -EFAULT;
+    bf_stats_deliver(bfdev, i, false, now);
+    hdr.pending[i / 32] |= 1U << (i % 32);
+    off += sizeof(delta);
+  }
+
+  if (off == sizeof(hdr))
+    return 0;
+  if (copy_to_user(buf, &hdr, sizeof(hdr)))
+    return -EFAULT;
+  return off;
+}
+
 /* user space support: make read() system call after poll() of select() */
 static ssize_t bf_read(struct file *filep, char __user *buf,
                        size_t count, loff_t *ppos)
 {
   struct bf_listener *listener = filep->private_data;
   struct bf_pci_dev *bfdev = listener->bfdev;
-  int retval, event_count[BF_MSIX_ENTRY_CNT];
-  int i, mismatch_found = 0;  /* OR of per vector mismatch */
-  unsigned char cnt_match[BF_MSIX_ENTRY_CNT]; /* per vector mismatch */
+  s32 stack_count[BF_READ_STACK_CNT];
+  s32 *event_count = stack_count;
+  int i, n, retval, mismatch_found = 0;  /* OR of per vector mismatch */
+  DECLARE_BITMAP(cnt_match, BF_MSIX_ENTRY_CNT); /* per vector mismatch */
+  DECLARE_WAITQUEUE(wait, current);
 
   if (!bfdev) {
     return -ENODEV;
@@ -584,41 +1901,73 @@ static ssize_t bf_read(struct file *filep, char __user *buf,
 
   /* ensure that there is enough space on user buffer for the given interrupt
    * mode */
-  if (bfdev->mode == BF_INTR_MODE_MSIX) {
-    if (count < sizeof(s32)*BF_MSIX_ENTRY_CNT)
+  if (listener->read_fmt == BF_READ_FMT_PENDING) {
+    /* the bitmap and at least one delta */
+    if (count < sizeof(struct bf_read_pending) + sizeof(u32))
       return -EINVAL;
-    count = sizeof(s32)*BF_MSIX_ENTRY_CNT;
-  } else if (bfdev->mode == BF_INTR_MODE_MSI) {
-    if (count < sizeof(s32)*BF_MSI_ENTRY_CNT)
-      return -EINVAL;
-    count = sizeof(s32)*BF_MSI_ENTRY_CNT;
   } else {
-    if (count < sizeof(s32))
+    n = bf_read_counters(bfdev, listener);
+    if (count < sizeof(s32) * n)
       return -EINVAL;
-    count = sizeof(s32);
+    count = sizeof(s32) * n;
+    /* the snapshot is per call, readers sharing the fd may race */
+    if (n > BF_READ_STACK_CNT) {
+      event_count = kmalloc(count, GFP_KERNEL);
+      if (!event_count)
+        return -ENOMEM;
+    }
   }
 
+  add_wait_queue(&listener->wait, &wait);
+
   do {
     set_current_state(TASK_INTERRUPTIBLE);
 
-    for (i = 0; i < (count/sizeof(s32)); i++) {
-      event_count[i] = atomic_read(&(bfdev->info.event[i]));
-      if (event_count[i] != listener->event_count[i]) {
-        mismatch_found |= 1;
-        cnt_match[i] = 1;
-      } else {
-        event_count[i] = 0;
-        cnt_match[i] = 0;
+    /* the device may have been removed while we were asleep */
+    if (!listener->bfdev) {
+      retval = -ENODEV;
+      break;
+    }
+
+    if (listener->read_fmt == BF_READ_FMT_PENDING) {
+      if (!bitmap_empty(listener->pending, listener->num_vec)) {
+        __set_current_state(TASK_RUNNING);
+        retval = bf_read_pending(listener, bfdev, buf, count);
+        if (retval)
+          break;
+        /* only stale bits were set, wait for the next interrupt */
+        continue;
+      }
+    } else {
+      for (i = 0; i < (count/sizeof(s32)); i++) {
+        if (i >= listener->num_vec) {
+          /* padding of the MSI-X format */
+          event_count[i] = 0;
+          __clear_bit(i, cnt_match);
+          continue;
+        }
+        event_count[i] = atomic_read(&(bfdev->info.event[i]));
+        if (event_count[i] != listener->event_count[i] &&
+            test_bit(i, listener->subscribed)) {
+          mismatch_found |= 1;
+          __set_bit(i, cnt_match);
+        } else {
+          event_count[i] = 0;
+          __clear_bit(i, cnt_match);
+        }
       }
     }
     if (mismatch_found) {
       __set_current_state(TASK_RUNNING);
-      if (copy_to_user(buf, &event_count, count))
+      if (copy_to_user(buf, event_count, count))
         retval = -EFAULT;
       else { /* adjust the listener->event_count; */
+        u64 now = bf_now_ns();
+
         for (i = 0 ; i < (count/sizeof(s32)); i++) {
-          if (cnt_match[i]) {
+          if (test_bit(i, cnt_match)) {
             listener->event_count[i] = event_count[i];
+            bf_stats_deliver(bfdev, i, false, now);
           }
         }
         retval = count;
@@ -639,7 +1988,11 @@ static ssize_t bf_read(struct file *filep, char __user *buf,
   } while (1);
 
   __set_current_state(TASK_RUNNING);
+  remove_wait_queue(&listener->wait, &wait);
 
+  if (event_count != stack_count)
+    kfree(event_count);
+  trace_bf_read(listener->minor, listener->read_fmt, retval);
   return retval;
 }
 
@@ -666,6 +2019,7 @@ static ssize_t bf_write(struct file *filep, const char __user *buf,
   /* clear pci_error_state */
   bfdev->info.pci_error_state = 0;
 
+  trace_bf_irqcontrol(bfdev->info.minor, int_en);
   ret = bf_pci_irqcontrol(bfdev, int_en);
 
   return ret ? ret : sizeof(s32);
@@ -680,9 +2034,16 @@ static const struct file_operations bf_fops = {
   .mmap           = bf_mmap,
   .poll           = bf_poll,
   .fasync         = bf_fasync,
+  .unlocked_ioctl = bf_ioctl,
+#ifdef CONFIG_COMPAT
+  .compat_ioctl   = bf_ioctl,
+#endif
 };
 
-static int bf_major_init(struct bf_pci_dev *bfdev, int minor)
+/* the char device region, cdev and class are shared by all the devices
+ * and set up once at module load, before any probe can run
+ */
+static int bf_major_init(void)
 {
   struct cdev *cdev;
   static const char name[] = "bf";
@@ -703,11 +2064,13 @@ static int bf_major_init(struct bf_pci_dev *bfdev, int minor)
   kobject_set_name(&cdev->kobj, "%s", name);
   result = cdev_add(cdev, bf_dev, BF_MAX_DEVICE_CNT);
 
-  if (result)
+  if (result) {
+    kobject_put(&cdev->kobj);
     goto fail_dev_add;
+  }
 
   bf_major = MAJOR(bf_dev);
-  bf_global[minor].bf_cdev = cdev;
+  bf_cdev = cdev;
   return 0;
 
 fail_dev_add:
@@ -715,38 +2078,164 @@ fail_dev_add:
   return result;
 }
 
-static void bf_major_cleanup(struct bf_pci_dev *bfdev, int minor)
+static void bf_major_cleanup(void)
 {
+  cdev_del(bf_cdev);
   unregister_chrdev_region(MKDEV(bf_major, 0), BF_MAX_DEVICE_CNT);
-  cdev_del(bf_global[minor].bf_cdev);
 }
 
-static int bf_init_cdev(struct bf_pci_dev *bfdev, int minor)
+static int bf_init_cdev(void)
 {
   int ret;
-  ret = bf_major_init(bfdev, minor);
+  ret = bf_major_init();
   if (ret)
    return ret;
   
   bf_class = class_create(THIS_MODULE, BF_CLASS_NAME);
-  if (!bf_class) {
+  if (IS_ERR(bf_class)) {
     printk(KERN_ERR "create_class failed for bf_dev\n");
-    ret = -ENODEV;
+    ret = PTR_ERR(bf_class);
+    bf_class = NULL;
     goto err_class_register;
   }
   return 0;
 
 err_class_register:
-  bf_major_cleanup(bfdev, minor);
+  bf_major_cleanup();
   return ret;
 }
 
-static void bf_remove_cdev(struct bf_pci_dev *bfdev)
+static void bf_remove_cdev(void)
 {
   class_destroy(bf_class);
-  bf_major_cleanup(bfdev, bfdev->info.minor);
+  bf_major_cleanup();
+}
+
+static void bf_stats_show_hist(struct seq_file *m, const char *name,
+                               const u32 *hist)
+{
+  int b;
+
+  seq_printf(m, "  %-6s", name);
+  for (b = 0; b < BF_LAT_BUCKETS; b++)
+    seq_printf(m, " %u", hist[b]);
+  seq_putc(m, '\n');
+}
+
+/* debugfs bf_kdrv/bf<n>/intr_stats. Histogram bucket 0 counts latencies
+ * below 1us, bucket n those in [2^(n-1), 2^n) us, the last one the rest.
+ * Writing anything to the file clears the statistics.
+ */
+static int bf_stats_show(struct seq_file *m, void *v)
+{
+  struct bf_pci_dev *bfdev = m->private;
+  u64 elapsed_ms;
+  int i;
+
+  elapsed_ms = div_u64(bf_now_ns() - bfdev->stats_reset_ns, NSEC_PER_MSEC);
+  seq_printf(m, "elapsed_ms %llu\n", elapsed_ms);
+  for (i = 0; bf_vector_irq(bfdev, i); i++) {
+    struct bf_intr_stats *st = &bfdev->stats[i];
+
+    if (!st->count)
+      continue;
+    seq_printf(m, "vector %d count %llu injected %llu rate %llu/s%s\n", i,
+               st->count, st->injected,
+               elapsed_ms ? div64_u64(st->count * MSEC_PER_SEC, elapsed_ms)
+                          : 0,
+               test_bit(i, bfdev->intr_polled) ? " polled" : "");
+    bf_stats_show_hist(m, "read", st->lat_read);
+    bf_stats_show_hist(m, "poll", st->lat_poll);
+    bf_stats_show_hist(m, "rearm", st->lat_rearm);
+  }
+  return 0;
+}
+
+static int bf_stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, bf_stats_show, inode->i_private);
+}
+
+static ssize_t bf_stats_write(struct file *file, const char __user *buf,
+                              size_t count, loff_t *ppos)
+{
+  struct bf_pci_dev *bfdev = ((struct seq_file *)file->private_data)->private;
+
+  memset(bfdev->stats, 0, bfdev->num_vec * sizeof(*bfdev->stats));
+  bfdev->stats_reset_ns = bf_now_ns();
+  return count;
+}
+
+static const struct file_operations bf_stats_fops = {
+  .owner   = THIS_MODULE,
+  .open    = bf_stats_open,
+  .read    = seq_read,
+  .write   = bf_stats_write,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+/* debugfs bf_kdrv/bf<n>/inject: writing "<vector> [<count>]" runs the
+ * interrupt delivery path for the vector count times, as if the device had
+ * raised it, without touching the device or its interrupt moderation.
+ * Meant for benchmarking the read()/poll() paths on machines without a
+ * Tofino.
+ */
+#define BF_INJECT_MAX 10000000
+
+static ssize_t bf_inject_write(struct file *file, const char __user *buf,
+                               size_t count, loff_t *ppos)
+{
+  struct bf_pci_dev *bfdev = file->private_data;
+  unsigned int vector, n = 1, i;
+  unsigned long flags;
+  char kbuf[32];
+
+  if (count >= sizeof(kbuf))
+    return -EINVAL;
+  if (copy_from_user(kbuf, buf, count))
+    return -EFAULT;
+  kbuf[count] = '\0';
+  if (sscanf(kbuf, "%u %u", &vector, &n) < 1)
+    return -EINVAL;
+  if (vector >= bfdev->num_vec || n == 0 || n > BF_INJECT_MAX)
+    return -EINVAL;
+
+  for (i = 0; i < n; i++) {
+    local_irq_save(flags);
+    bf_intr_deliver(&bfdev->bf_int_vec[vector], true);
+    local_irq_restore(flags);
+    if (signal_pending(current))
+      return -EINTR;
+    cond_resched();
+  }
+  return count;
 }
 
+static const struct file_operations bf_inject_fops = {
+  .owner   = THIS_MODULE,
+  .open    = simple_open,
+  .write   = bf_inject_write,
+  .llseek  = no_llseek,
+};
+
+static void bf_debugfs_add(struct bf_pci_dev *bfdev)
+{
+  char name[16];
+
+  if (IS_ERR_OR_NULL(bf_debugfs_root))
+    return;
+  snprintf(name, sizeof(name), "bf%d", bfdev->info.minor);
+  bfdev->debugfs_dir = debugfs_create_dir(name, bf_debugfs_root);
+  if (IS_ERR_OR_NULL(bfdev->debugfs_dir)) {
+    bfdev->debugfs_dir = NULL;
+    return;
+  }
+  debugfs_create_file("intr_stats", S_IRUSR | S_IWUSR, bfdev->debugfs_dir,
+                      bfdev, &bf_stats_fops);
+  debugfs_create_file("inject", S_IWUSR, bfdev->debugfs_dir, bfdev,
+                      &bf_inject_fops);
+}
 
 /**
  * bf_register_device - register a new userspace mem device
@@ -764,32 +2253,30 @@ int bf_register_device(struct device *parent, struct bf_pci_dev *bfdev)
   if (!parent || !info || !info->version)
     return -EINVAL;
 
-  init_waitqueue_head(&info->wait);
-
-  for (i = 0; i < BF_MSIX_ENTRY_CNT; i++) {
+  for (i = 0; i < bfdev->num_vec; i++)
     atomic_set(&info->event[i], 0);
-  }
+  spin_lock_init(&info->efd_lock);
 
   if (bf_get_next_minor_no(&minor)) {
     return -EINVAL;
   }
+  info->minor = minor;
+  snprintf(bfdev->name, sizeof(bfdev->name), "bf_%d", minor);
 
-  ret = bf_init_cdev(bfdev, minor);
-  if (ret) {
-    printk(KERN_ERR "BF: device cdev creation failed\n");
-    return ret;
-  }
+  /* open() may come in as soon as the device node shows up */
+  bf_global[minor].async_queue = NULL;
+  bf_global[minor].bfdev = bfdev;
 
   info->dev = device_create(bf_class, parent,
                             MKDEV(bf_major, minor), bfdev,
                             "bf%d", minor);
-  if (!info->dev) {
+  if (IS_ERR(info->dev)) {
     printk(KERN_ERR "BF: device creation failed\n");
-    return -ENODEV;
+    ret = PTR_ERR(info->dev);
+    info->dev = NULL;
+    goto fail_minor;
   }
 
-  info->minor = minor;
-
   /* bind ISRs and request interrupts */
   if (info->irq && (bfdev->mode != BF_INTR_MODE_NONE)) {
     /*
@@ -807,7 +2294,7 @@ int bf_register_device(struct device *parent, struct bf_pci_dev *bfdev)
       if (ret) {
         printk(KERN_ERR "bf failed to request legacy irq %ld error %d\n",
                info->irq, ret);
-        return ret;
+        goto fail_device;
       }
       printk(KERN_NOTICE "BF allocating legacy int vector %ld\n", info->irq);
     } else if (bfdev->mode == BF_INTR_MODE_MSIX) {
@@ -822,7 +2309,7 @@ int bf_register_device(struct device *parent, struct bf_pci_dev *bfdev)
             free_irq(info->msix_entries[j].vector,
                      (void *)&(bfdev->bf_int_vec[j]));
           }
-          return ret;
+          goto fail_device;
         } 
       }
       printk(KERN_NOTICE "BF allocating %d MSIx vectors from  %ld\n",
@@ -838,14 +2325,24 @@ int bf_register_device(struct device *parent, struct bf_pci_dev *bfdev)
           for (j = i - 1; j >= 0; j--) {
             free_irq(info->irq + j, (void *)&(bfdev->bf_int_vec[j]));
           }
-          return ret;
+          goto fail_device;
         } 
       }
       printk(KERN_NOTICE "BF allocating %d MSI vectors from  %ld\n",
              info->num_irq, info->irq);
     }
+    if (intr_numa_spread)
+      bf_spread_irq_affinity(bfdev);
   }
+  bf_debugfs_add(bfdev);
   return 0;
+
+fail_device:
+  device_destroy(bf_class, MKDEV(bf_major, minor));
+fail_minor:
+  bf_detach_listeners(bfdev);
+  bf_return_minor_no(minor);
+  return ret;
 }
 
 /**
@@ -859,7 +2356,14 @@ void bf_unregister_device(struct bf_pci_dev *bfdev)
   struct bf_dev_info *info = &bfdev->info;
   int i;
 
+  debugfs_remove_recursive(bfdev->debugfs_dir);
+  bfdev->debugfs_dir = NULL;
   if (info->irq) {
+    /* affinity hints must be gone before the irqs are freed */
+    for (i = 0; bf_vector_irq(bfdev, i); i++) {
+      if (bfdev->bf_int_vec[i].cpu >= 0)
+        bf_set_vector_affinity(bfdev, i, -1);
+    }
     if (bfdev->mode == BF_INTR_MODE_LEGACY) {
       free_irq(info->irq, (void *)&(bfdev->bf_int_vec[0]));
     } else if (bfdev->mode == BF_INTR_MODE_MSIX) {
@@ -873,11 +2377,38 @@ void bf_unregister_device(struct bf_pci_dev *bfdev)
     }
   }
   device_destroy(bf_class, MKDEV(bf_major, info->minor));
-  bf_remove_cdev(bfdev);
   bf_return_minor_no(info->minor);
   return;
 }
 
+/* size the per vector state after the number of vectors the device got */
+static int bf_alloc_vectors(struct bf_pci_dev *bfdev)
+{
+  int i, n = max(bfdev->info.num_irq, 1);
+
+  bfdev->num_vec = n;
+  bfdev->bf_int_vec = kcalloc(n, sizeof(*bfdev->bf_int_vec), GFP_KERNEL);
+  bfdev->info.efd = kcalloc(n, sizeof(*bfdev->info.efd), GFP_KERNEL);
+  bfdev->info.efd_owner = kcalloc(n, sizeof(*bfdev->info.efd_owner),
+                                  GFP_KERNEL);
+  bfdev->stats = vzalloc(n * sizeof(*bfdev->stats));
+  if (!bfdev->bf_int_vec || !bfdev->info.efd || !bfdev->info.efd_owner ||
+      !bfdev->stats) {
+    bf_free_vectors(bfdev);
+    return -ENOMEM;
+  }
+
+  /* init the cookies to be passed to ISRs */
+  for (i = 0; i < n; i++) {
+    bfdev->bf_int_vec[i].int_vec_offset = i;
+    bfdev->bf_int_vec[i].bf_dev = bfdev;
+    bfdev->bf_int_vec[i].cpu = -1;
+  }
+  if (bfdev->mode == BF_INTR_MODE_MSIX)
+    bf_msix_map_descs(bfdev);
+  return 0;
+}
+
 static inline struct device *pci_dev_to_dev(struct pci_dev *pdev)
 {
   return &pdev->dev;
@@ -888,19 +2419,29 @@ bf_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {
   struct bf_pci_dev *bfdev;
   int err, pci_use_highmem;
-  int i, num_irq;
-
-  memset(bf_global, 0, sizeof(bf_global));
+  int i, num_irq, max_irq;
 
   bfdev = kzalloc(sizeof(struct bf_pci_dev), GFP_KERNEL);
   if (!bfdev)
     return -ENOMEM;
 
-  /* init the cookies to be passed to ISRs */
-  for (i = 0; i < BF_MSIX_ENTRY_CNT; i++) {
-    bfdev->bf_int_vec[i].int_vec_offset = i;
-    bfdev->bf_int_vec[i].bf_dev = bfdev;
+  /* event counters get a page of their own so that they can be mmapped */
+  BUILD_BUG_ON(BF_MSIX_ENTRY_CNT * sizeof(atomic_t) > PAGE_SIZE);
+  BUILD_BUG_ON(BF_MMAP_EVENT_PGOFF < BF_MAX_BAR_MAPS);
+  BUILD_BUG_ON(BF_MMAP_DMA_PGOFF_BASE + BF_DMA_MAX_BUFS >
+               BF_MMAP_BAR_PGOFF_BASE);
+  BUILD_BUG_ON(BF_MSIX_ENTRY_CNT > BF_READ_PENDING_BITS);
+  bfdev->info.event = (atomic_t *)get_zeroed_page(GFP_KERNEL);
+  if (!bfdev->info.event) {
+    kfree(bfdev);
+    return -ENOMEM;
   }
+  bfdev->stats_reset_ns = bf_now_ns();
+
+  kref_init(&bfdev->ref);
+  spin_lock_init(&bfdev->mask_lock);
+  mutex_init(&bfdev->dma_lock);
+  idr_init(&bfdev->dma_idr);
 
   /* initialize intr_mode to none */
   bfdev->mode = BF_INTR_MODE_NONE;
@@ -959,6 +2500,8 @@ bf_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
    * to indicate the error condition.
    */
   pci_enable_pcie_error_reporting(pdev);
+  /* config space to restore after a slot reset, see bf_pci_slot_reset() */
+  pci_save_state(pdev);
 
   /* enable bus mastering on the device */
   pci_set_master(pdev);
@@ -971,20 +2514,29 @@ bf_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
   switch (bf_intr_mode_default) {
 #ifdef CONFIG_PCI_MSI
   case BF_INTR_MODE_MSIX:
-    /* Only 1 msi-x vector needed */
-    bfdev->info.msix_entries = kcalloc(BF_MSIX_ENTRY_CNT,
-                                       sizeof(struct msix_entry), GFP_KERNEL);
-    if (!bfdev->info.msix_entries) {
-      err = -ENOMEM;
-      goto fail_clear_pci_master;
-    }
-    for (i = 0; i < BF_MSIX_ENTRY_CNT; i++) {
-      bfdev->info.msix_entries[i].entry= i;
+    /* ask for all the vectors the device has and settle for fewer if
+     * that is all the platform can give
+     */
+    max_irq = min_t(int, pci_msix_vec_count(pdev), BF_MSIX_ENTRY_CNT);
+    num_irq = -ENOSPC;
+    if (max_irq > 0) {
+      bfdev->info.msix_entries = kcalloc(max_irq, sizeof(struct msix_entry),
+                                         GFP_KERNEL);
+      if (!bfdev->info.msix_entries) {
+        err = -ENOMEM;
+        goto fail_clear_pci_master;
+      }
+      for (i = 0; i < max_irq; i++) {
+        bfdev->info.msix_entries[i].entry= i;
+      }
+      num_irq = pci_enable_msix_range(pdev, bfdev->info.msix_entries,
+                                      1, max_irq);
     }
-    num_irq = pci_enable_msix_range(pdev, bfdev->info.msix_entries,
-                                    BF_MSIX_ENTRY_CNT, BF_MSIX_ENTRY_CNT);
-    if (num_irq == BF_MSIX_ENTRY_CNT) {
+    if (num_irq > 0) {
 	    dev_dbg(&pdev->dev, "using MSI-X");
+      if (num_irq < max_irq)
+        dev_notice(&pdev->dev, "got %d of %d MSI-X vectors\n", num_irq,
+                   max_irq);
       bfdev->info.num_irq = num_irq;
 		  bfdev->info.irq = bfdev->info.msix_entries[0].vector;
 		  bfdev->mode = BF_INTR_MODE_MSIX;
@@ -992,8 +2544,6 @@ bf_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
              bfdev->info.irq);
 		  break;
     } else {
-      if (num_irq)
-        pci_disable_msix(pdev);
       kfree(bfdev->info.msix_entries);
       bfdev->info.msix_entries = NULL;
       printk(KERN_ERR "bf error allocating MSIX vectors. Trying MSI...\n");
@@ -1037,18 +2587,18 @@ bf_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
     goto fail_clear_pci_master;
   }
 
+  err = bf_alloc_vectors(bfdev);
+  if (err != 0)
+    goto fail_release_irq;
+
   pci_set_drvdata(pdev, bfdev);
-  sprintf(bfdev->name, "bf_%d", bfdev->info.minor);
   /* register bf driver */
   err = bf_register_device(&pdev->dev, bfdev);
   if (err != 0)
     goto fail_release_irq;
 
-  bf_global[bfdev->info.minor].async_queue = NULL;
-  bf_global[bfdev->info.minor].bfdev = bfdev;
-
   dev_info(&pdev->dev, "bf device %d registered with irq %ld\n",
-  bfdev->instance, bfdev->info.irq);
+  bfdev->info.minor, bfdev->info.irq);
   printk(KERN_ALERT "bf probe ok\n");
   return 0;
 
@@ -1069,7 +2619,7 @@ fail_release_iomem:
 fail_pci_disable:
   pci_disable_device(pdev);
 fail_free:
-  kfree(bfdev);
+  kref_put(&bfdev->ref, bf_pci_dev_release);
 
   printk(KERN_ERR "bf probe not ok\n");
   return err;
@@ -1079,9 +2629,16 @@ static void
 bf_pci_remove(struct pci_dev *pdev)
 {
   struct bf_pci_dev *bfdev = pci_get_drvdata(pdev);
-  struct bf_listener *cur_listener;
+
+  /* before its minor is given back by bf_unregister_device(), a
+   * concurrent probe may reuse it right away
+   */
+  bf_detach_listeners(bfdev);
 
   bf_unregister_device(bfdev);
+  bf_release_intr_eventfds(bfdev, NULL);
+  bf_dma_free(bfdev, NULL, -1);
+  idr_destroy(&bfdev->dma_idr);
   if (bfdev->mode == BF_INTR_MODE_MSIX) {
     pci_disable_msix(pdev);
     kfree(bfdev->info.msix_entries);
@@ -1095,17 +2652,8 @@ bf_pci_remove(struct pci_dev *pdev)
   pci_disable_pcie_error_reporting(pdev);
   pci_disable_device(pdev);
   pci_set_drvdata(pdev, NULL);
-  bf_global[bfdev->info.minor].bfdev = NULL;
-  /* existing filep structures in open file(s) must be informed that
-   * bf_pci_dev is no longer valid */
-  spin_lock(&bf_nonisr_lock);
-  cur_listener = bfdev->listener_head;
-  while (cur_listener) {
-    cur_listener->bfdev = NULL;
-    cur_listener = cur_listener->next;
-  }
-  spin_unlock(&bf_nonisr_lock);
-  kfree(bfdev);
+  /* freed once the last open file is released */
+  kref_put(&bfdev->ref, bf_pci_dev_release);
 }
 
 /**
@@ -1132,6 +2680,11 @@ static pci_ers_result_t bf_pci_error_detected(struct pci_dev *pdev,
     if (minor < BF_MAX_DEVICE_CNT && bf_global[minor].async_queue) {
       kill_fasync(&bf_global[minor].async_queue, SIGIO, POLL_ERR);
     }
+    if (warm_recovery && state == pci_channel_io_frozen) {
+      /* re-enabled by bf_pci_slot_reset() */
+      pci_disable_device(pdev);
+      return PCI_ERS_RESULT_NEED_RESET;
+    }
     return PCI_ERS_RESULT_DISCONNECT;
   } else {
     return PCI_ERS_RESULT_NONE;
@@ -1146,11 +2699,28 @@ static pci_ers_result_t bf_pci_error_detected(struct pci_dev *pdev,
  */
 static pci_ers_result_t bf_pci_slot_reset(struct pci_dev *pdev)
 {
-  /* nothing to do for now as we do not expect to get backto normal after
-   * a pcie link reset
-   * TBD: fill in this function if tofino can recover after an error
+  struct bf_pci_dev *bfdev = pci_get_drvdata(pdev);
+
+  /* without warm_recovery we do not expect to get back to normal after a
+   * pcie link reset
+   */
+  if (!bfdev || !warm_recovery)
+    return PCI_ERS_RESULT_DISCONNECT;
+
+  /* put back the config space saved at probe time, MSI-X table included,
+   * so that the mmaps, DMA buffers and interrupt setup of the running
+   * user space driver stay valid; it re-initializes the chip itself
    */
-  return PCI_ERS_RESULT_DISCONNECT;
+  if (pci_enable_device(pdev)) {
+    printk(KERN_ERR "BF cannot re-enable device after slot reset\n");
+    return PCI_ERS_RESULT_DISCONNECT;
+  }
+  pci_restore_state(pdev);
+  pci_save_state(pdev);
+  pci_set_master(pdev);
+  printk(KERN_NOTICE "BF device %d recovered from slot reset\n",
+         bfdev->info.minor);
+  return PCI_ERS_RESULT_RECOVERED;
 }
 
 /**
@@ -1162,10 +2732,15 @@ static pci_ers_result_t bf_pci_slot_reset(struct pci_dev *pdev)
  */
 static void bf_pci_resume(struct pci_dev *pdev)
 {
-  /* this function should never be called  for Tofinoi */
+  /* only reached with warm_recovery, after bf_pci_slot_reset() restored
+   * the config space. The BAR mmaps, DMA buffers (persistent ones and the
+   * ranges pinned by the still running process) and interrupt vectors
+   * are all as they were before the error; clearing pci_error_state lets
+   * user space, told about the error through SIGIO, re-initialize the chip
+   */
   struct bf_pci_dev *bfdev = pci_get_drvdata(pdev);
 
-  printk(KERN_ERR "BF io_resume invoked after pci error\n");
+  printk(KERN_NOTICE "BF io_resume invoked after pci error\n");
   if (bfdev) {
     bfdev->info.pci_error_state = 0;
   }
@@ -1215,7 +2790,13 @@ static struct pci_driver bf_pci_driver = {
   .id_table = bf_pci_tbl,
   .probe = bf_pci_probe,
   .remove = bf_pci_remove,
-  .err_handler = &bf_pci_err_handler
+  .err_handler = &bf_pci_err_handler,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+  /* each device is probed on its own, in parallel with the others; the
+   * state shared between them is set up in bfdrv_init()
+   */
+  .driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 };
 
 static int __init
@@ -1228,13 +2809,27 @@ bfdrv_init(void)
     return ret;
 
   spin_lock_init(&bf_nonisr_lock);
-  return pci_register_driver(&bf_pci_driver);
+  ret = bf_init_cdev();
+  if (ret) {
+    printk(KERN_ERR "BF: device cdev creation failed\n");
+    return ret;
+  }
+  /* debugfs is optional, the driver works without it */
+  bf_debugfs_root = debugfs_create_dir("bf_kdrv", NULL);
+  ret = pci_register_driver(&bf_pci_driver);
+  if (ret) {
+    debugfs_remove_recursive(bf_debugfs_root);
+    bf_remove_cdev();
+  }
+  return ret;
 }
 
 static void __exit
 bfdrv_exit(void)
 {
   pci_unregister_driver(&bf_pci_driver);
+  debugfs_remove_recursive(bf_debugfs_root);
+  bf_remove_cdev();
 }
 
 module_init(bfdrv_init);
@@ -1248,6 +2843,16 @@ MODULE_PARM_DESC(intr_mode,
 "    " BF_INTR_MODE_LEGACY_NAME "     Use Legacy interrupt\n"
 "\n");
 
+module_param(intr_numa_spread, bool, S_IRUGO);
+MODULE_PARM_DESC(intr_numa_spread,
+"spread interrupt vectors over the cpus of the device's NUMA node "
+"(default=1)");
+
+module_param(warm_recovery, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(warm_recovery,
+"recover from a frozen pcie link through a slot reset, keeping the "
+"device setup, instead of disconnecting (default=0)");
+
 MODULE_DEVICE_TABLE(pci, bf_pci_tbl);
 MODULE_DESCRIPTION("Barefoot Tofino PCI device");
 MODULE_LICENSE("GPL");
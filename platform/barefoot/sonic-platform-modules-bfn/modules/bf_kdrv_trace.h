@@ -0,0 +1,132 @@
+/*******************************************************************************
+ * BAREFOOT NETWORKS CONFIDENTIAL & PROPRIETARY
+ *
+ * Copyright (c) 2015-2016 Barefoot Networks, Inc.
+
+ * All Rights Reserved.
+ *
+ * NOTICE: All information contained herein is, and remains the property of
+ * Barefoot Networks, Inc. and its suppliers, if any. The intellectual and
+ * technical concepts contained herein are proprietary to Barefoot Networks,
+ * Inc.
+ * and its suppliers and may be covered by U.S. and Foreign Patents, patents in
+ * process, and are protected by trade secret or copyright law.
+ * Dissemination of this information or reproduction of this material is
+ * strictly forbidden unless prior written permission is obtained from
+ * Barefoot Networks, Inc.
+ *
+ * No warranty, explicit or implicit is provided, unless granted under a
+ * written agreement with Barefoot Networks, Inc.
+ *
+ * $Id: $
+ *
+ ******************************************************************************/
+/**
+ *
+ * GPL LICENSE SUMMARY
+ *
+ *   Copyright(c) 2015 Barefoot Networks. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of version 2 of the GNU General Public License as
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the...
+ *
+ **/
+
+
+/* bf_kdrv tracepoints
+ *
+ * Enable with e.g.
+ *   echo 1 > /sys/kernel/debug/tracing/events/bf_kdrv/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bf_kdrv
+
+#if !defined(_BF_KDRV_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _BF_KDRV_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* an interrupt vector fired; count is its event counter after the update */
+TRACE_EVENT(bf_interrupt,
+  TP_PROTO(int minor, int vector, int count),
+  TP_ARGS(minor, vector, count),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(int, vector)
+    __field(int, count)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->vector = vector;
+    __entry->count = count;
+  ),
+  TP_printk("bf%d vector=%d count=%d",
+            __entry->minor, __entry->vector, __entry->count)
+);
+
+/* read() is returning to user space */
+TRACE_EVENT(bf_read,
+  TP_PROTO(int minor, int fmt, long ret),
+  TP_ARGS(minor, fmt, ret),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(int, fmt)
+    __field(long, ret)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->fmt = fmt;
+    __entry->ret = ret;
+  ),
+  TP_printk("bf%d fmt=%d ret=%ld",
+            __entry->minor, __entry->fmt, __entry->ret)
+);
+
+/* poll() found an event to report; vector is the first one it saw */
+TRACE_EVENT(bf_poll,
+  TP_PROTO(int minor, int vector),
+  TP_ARGS(minor, vector),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(int, vector)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->vector = vector;
+  ),
+  TP_printk("bf%d vector=%d", __entry->minor, __entry->vector)
+);
+
+/* user space enabled (state 1) or disabled interrupts through write() */
+TRACE_EVENT(bf_irqcontrol,
+  TP_PROTO(int minor, int state),
+  TP_ARGS(minor, state),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(int, state)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->state = state;
+  ),
+  TP_printk("bf%d state=%d", __entry->minor, __entry->state)
+);
+
+#endif /* _BF_KDRV_TRACE_H_ */
+
+/* this part must be outside the multi-read protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE bf_kdrv_trace
+#include <trace/define_trace.h>
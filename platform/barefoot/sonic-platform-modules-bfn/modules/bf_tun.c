@@ -65,6 +65,12 @@
 #include <linux/nsproxy.h>
 #include <linux/virtio_net.h>
 #include <linux/rcupdate.h>
+#include <linux/rculist_bl.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
 #include <net/ipv6.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
@@ -74,6 +80,8 @@
 
 #include <asm/uaccess.h>
 
+#include "bf_tun.h"
+
 /* Uncomment to enable debugging */
 /* #define TUN_DEBUG 1 */
 
@@ -122,6 +130,19 @@ struct tap_filter {
 
 #define TUN_FLOW_EXPIRE (3 * HZ)
 
+/* Shared rx/tx frame rings of a tun_file, see TUNSETRING */
+struct tun_ring {
+	void *buf;
+	size_t size;
+	u32 frame_size;
+	u32 rx_frame_nr;
+	u32 tx_frame_nr;
+	u32 rx_head;		/* next rx frame to fill, under rx_lock */
+	u32 tx_head;		/* next tx frame to send, under tx_mutex */
+	spinlock_t rx_lock;
+	struct mutex tx_mutex;
+};
+
 /* A tun_file connects an open character device to a tuntap netdevice. It
  * also contains all socket related structures (except sock_fprog and tap_filter)
  * to serve as one transmit queue for tuntap device. The sock_fprog and
@@ -148,10 +169,13 @@ struct tun_file {
 	};
 	struct list_head next;
 	struct tun_struct *detached;
+	struct tun_ring __rcu *ring;
+	struct napi_struct napi;
+	bool napi_enabled;
 };
 
 struct tun_flow_entry {
-	struct hlist_node hash_link;
+	struct hlist_bl_node hash_link;
 	struct rcu_head rcu;
 	struct tun_struct *tun;
 
@@ -161,7 +185,79 @@ struct tun_flow_entry {
 	unsigned long updated;
 };
 
-#define TUN_NUM_FLOW_ENTRIES 1024
+/* The flow table is resized to keep about two flows per bucket, within
+ * these bounds.
+ */
+#define TUN_FLOW_MIN_BUCKETS	256
+#define TUN_FLOW_MAX_BUCKETS	(TUN_FLOWS_MAX / 2)
+
+/* Buckets are looked up under RCU; each has a bit lock in its head for
+ * writers. The table pointer itself changes only under flow_mutex.
+ */
+struct tun_flow_table {
+	u32 mask;
+	struct hlist_bl_head buckets[];
+};
+
+/* tun->flags bit for IFF_NAPI, next to the TUN_ ones from if_tun.h */
+#define TUN_NAPI	0x0800
+
+/* Why a packet was dropped, reported through ethtool -S. The tx reasons add
+ * up to tx_dropped and the rx ones to rx_dropped.
+ */
+enum tun_drop_reason {
+	TUN_DROP_TX_DETACHED,	/* no queue attached for the packet */
+	TUN_DROP_TX_FILTER,	/* rejected by the tap or socket filter */
+	TUN_DROP_TX_QUEUE_FULL,	/* reader is not keeping up */
+	TUN_DROP_TX_FRAGS,	/* could not orphan zerocopy frags */
+	TUN_DROP_TX_HDR,	/* no room or no vnet header for the ring */
+	TUN_DROP_RX_NOMEM,	/* skb allocation failed */
+	TUN_DROP_RX_FAULT,	/* copy from user space failed */
+	TUN_DROP_RX_PROTO,	/* not IPv4/IPv6 on a TUN without pi */
+	TUN_DROP_RX_FILTER,	/* dropped by the injection filter */
+	TUN_DROP_RX_POLICED,	/* over the injection policer rate */
+	TUN_DROP_MAX,
+};
+
+#define TUN_DROP_RX_FIRST TUN_DROP_RX_NOMEM
+
+static const char tun_drop_strings[TUN_DROP_MAX][ETH_GSTRING_LEN] = {
+	"tx_drop_detached",
+	"tx_drop_filter",
+	"tx_drop_queue_full",
+	"tx_drop_frags",
+	"tx_drop_hdr",
+	"rx_drop_nomem",
+	"rx_drop_fault",
+	"rx_drop_proto",
+	"rx_drop_filter",
+	"rx_drop_policed",
+};
+
+/* Per cpu counters, so that queues serviced on different cpus do not
+ * bounce a shared cache line. Folded in tun_net_get_stats64().
+ */
+struct tun_pcpu_stats {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 tx_packets;
+	u64 tx_bytes;
+	struct u64_stats_sync syncp;
+	u32 rx_frame_errors;
+	u32 drops[TUN_DROP_MAX];
+};
+
+/* Token bucket for TUN_INJ_POLICE() verdicts, tokens are in ns */
+struct tun_policer {
+	spinlock_t lock;
+	u64 cost;		/* ns per packet, 0: disabled */
+	u64 depth;		/* cost * burst */
+	u64 tokens;
+	u64 last;
+};
+
+/* Scratch skbs the injection filter runs on, one per cpu */
+static DEFINE_PER_CPU(struct sk_buff *, tun_inj_skb);
 
 /* Since the socket were moved to tun_file, to preserve the behavior of persist
  * device, socket filter, sndbuf and vnet header size were restore when the
@@ -188,34 +284,91 @@ struct tun_struct {
 #ifdef TUN_DEBUG
 	int debug;
 #endif
-	spinlock_t lock;
-	struct hlist_head flows[TUN_NUM_FLOW_ENTRIES];
-	struct timer_list flow_gc_timer;
+	struct tun_flow_table __rcu *flows;
+	struct mutex flow_mutex;
+	struct delayed_work flow_gc_work;
+	struct work_struct flow_resize_work;
 	unsigned long ageing_time;
+	u32 max_flows;
 	unsigned int numdisabled;
 	struct list_head disabled;
 	void *security;
-	u32 flow_count;
+	atomic_t flow_count;
+	struct tun_pcpu_stats __percpu *pcpu_stats;
+	struct sk_filter __rcu *inj_filter;
+	struct sk_filter __rcu *steering_filter;
+	struct tun_policer inj_policers[TUN_INJ_POLICERS];
 };
 
-static inline u32 tun_hashfn(u32 rxhash)
+static inline void tun_drop(struct tun_struct *tun, enum tun_drop_reason why)
 {
-	return rxhash & 0x3ff;
+	this_cpu_inc(tun->pcpu_stats->drops[why]);
 }
 
-static struct tun_flow_entry *tun_flow_find(struct hlist_head *head, u32 rxhash)
+static struct tun_flow_table *tun_flow_table_alloc(u32 nbuckets)
+{
+	struct tun_flow_table *t;
+	size_t size = sizeof(*t) + nbuckets * sizeof(struct hlist_bl_head);
+	u32 i;
+
+	t = kzalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	if (!t)
+		t = vzalloc(size);
+	if (!t)
+		return NULL;
+
+	t->mask = nbuckets - 1;
+	for (i = 0; i < nbuckets; i++)
+		INIT_HLIST_BL_HEAD(&t->buckets[i]);
+	return t;
+}
+
+static void tun_flow_table_free(struct tun_flow_table *t)
+{
+	if (is_vmalloc_addr(t))
+		vfree(t);
+	else
+		kfree(t);
+}
+
+/* Table size for a number of flows */
+static u32 tun_flow_buckets(u32 flows)
+{
+	return clamp_t(u32, roundup_pow_of_two(max_t(u32, flows / 2, 1)),
+		       TUN_FLOW_MIN_BUCKETS, TUN_FLOW_MAX_BUCKETS);
+}
+
+static inline struct hlist_bl_head *tun_flow_bucket(struct tun_flow_table *t,
+						    u32 rxhash)
+{
+	return &t->buckets[rxhash & t->mask];
+}
+
+static struct tun_flow_entry *tun_flow_find(struct hlist_bl_head *head,
+					    u32 rxhash)
 {
 	struct tun_flow_entry *e;
+	struct hlist_bl_node *n;
 
-	hlist_for_each_entry_rcu(e, head, hash_link) {
+	hlist_bl_for_each_entry_rcu(e, n, head, hash_link) {
 		if (e->rxhash == rxhash)
 			return e;
 	}
 	return NULL;
 }
 
+/* Called with rcu_read_lock held */
+static struct tun_flow_entry *tun_flow_lookup(struct tun_struct *tun,
+					      u32 rxhash)
+{
+	struct tun_flow_table *t = rcu_dereference(tun->flows);
+
+	return tun_flow_find(tun_flow_bucket(t, rxhash), rxhash);
+}
+
+/* Called with the bucket locked */
 static struct tun_flow_entry *tun_flow_create(struct tun_struct *tun,
-					      struct hlist_head *head,
+					      struct hlist_bl_head *head,
 					      u32 rxhash, u16 queue_index)
 {
 	struct tun_flow_entry *e = kmalloc(sizeof(*e), GFP_ATOMIC);
@@ -228,97 +381,182 @@ static struct tun_flow_entry *tun_flow_create(struct tun_struct *tun,
 		e->rps_rxhash = 0;
 		e->queue_index = queue_index;
 		e->tun = tun;
-		hlist_add_head_rcu(&e->hash_link, head);
-		++tun->flow_count;
+		hlist_bl_add_head_rcu(&e->hash_link, head);
+		atomic_inc(&tun->flow_count);
 	}
 	return e;
 }
 
+/* Called with the bucket locked */
 static void tun_flow_delete(struct tun_struct *tun, struct tun_flow_entry *e)
 {
 	tun_debug(KERN_INFO, tun, "delete flow: hash %u index %u\n",
 		  e->rxhash, e->queue_index);
 	sock_rps_reset_flow_hash(e->rps_rxhash);
-	hlist_del_rcu(&e->hash_link);
+	hlist_bl_del_rcu(&e->hash_link);
 	kfree_rcu(e, rcu);
-	--tun->flow_count;
+	atomic_dec(&tun->flow_count);
+}
+
+static inline struct tun_flow_table *tun_flows_locked(struct tun_struct *tun)
+{
+	return rcu_dereference_protected(tun->flows,
+					 lockdep_is_held(&tun->flow_mutex));
 }
 
 static void tun_flow_flush(struct tun_struct *tun)
 {
-	int i;
+	struct tun_flow_table *t;
+	u32 i;
 
-	spin_lock_bh(&tun->lock);
-	for (i = 0; i < TUN_NUM_FLOW_ENTRIES; i++) {
+	mutex_lock(&tun->flow_mutex);
+	t = tun_flows_locked(tun);
+	for (i = 0; i <= t->mask; i++) {
+		struct hlist_bl_head *head = &t->buckets[i];
 		struct tun_flow_entry *e;
-		struct hlist_node *n;
+		struct hlist_bl_node *n, *tmp;
 
-		hlist_for_each_entry_safe(e, n, &tun->flows[i], hash_link)
+		hlist_bl_lock(head);
+		hlist_bl_for_each_entry_safe(e, n, tmp, head, hash_link)
 			tun_flow_delete(tun, e);
+		hlist_bl_unlock(head);
 	}
-	spin_unlock_bh(&tun->lock);
+	mutex_unlock(&tun->flow_mutex);
 }
 
 static void tun_flow_delete_by_queue(struct tun_struct *tun, u16 queue_index)
 {
-	int i;
+	struct tun_flow_table *t;
+	u32 i;
 
-	spin_lock_bh(&tun->lock);
-	for (i = 0; i < TUN_NUM_FLOW_ENTRIES; i++) {
+	mutex_lock(&tun->flow_mutex);
+	t = tun_flows_locked(tun);
+	for (i = 0; i <= t->mask; i++) {
+		struct hlist_bl_head *head = &t->buckets[i];
 		struct tun_flow_entry *e;
-		struct hlist_node *n;
+		struct hlist_bl_node *n, *tmp;
 
-		hlist_for_each_entry_safe(e, n, &tun->flows[i], hash_link) {
+		hlist_bl_lock(head);
+		hlist_bl_for_each_entry_safe(e, n, tmp, head, hash_link) {
 			if (e->queue_index == queue_index)
 				tun_flow_delete(tun, e);
 		}
+		hlist_bl_unlock(head);
 	}
-	spin_unlock_bh(&tun->lock);
+	mutex_unlock(&tun->flow_mutex);
 }
 
-static void tun_flow_cleanup(unsigned long data)
+static void tun_flow_cleanup(struct work_struct *work)
 {
-	struct tun_struct *tun = (struct tun_struct *)data;
-	unsigned long delay = tun->ageing_time;
+	struct tun_struct *tun = container_of(to_delayed_work(work),
+					      struct tun_struct, flow_gc_work);
+	unsigned long delay = ACCESS_ONCE(tun->ageing_time);
 	unsigned long next_timer = jiffies + delay;
 	unsigned long count = 0;
-	int i;
+	struct tun_flow_table *t;
+	u32 i;
 
 	tun_debug(KERN_INFO, tun, "tun_flow_cleanup\n");
 
-	spin_lock_bh(&tun->lock);
-	for (i = 0; i < TUN_NUM_FLOW_ENTRIES; i++) {
+	mutex_lock(&tun->flow_mutex);
+	t = tun_flows_locked(tun);
+	for (i = 0; i <= t->mask; i++) {
+		struct hlist_bl_head *head = &t->buckets[i];
 		struct tun_flow_entry *e;
-		struct hlist_node *n;
+		struct hlist_bl_node *n, *tmp;
 
-		hlist_for_each_entry_safe(e, n, &tun->flows[i], hash_link) {
+		hlist_bl_lock(head);
+		hlist_bl_for_each_entry_safe(e, n, tmp, head, hash_link) {
 			unsigned long this_timer;
-			count++;
 			this_timer = e->updated + delay;
-			if (time_before_eq(this_timer, jiffies))
+			if (time_before_eq(this_timer, jiffies)) {
 				tun_flow_delete(tun, e);
-			else if (time_before(this_timer, next_timer))
+				continue;
+			}
+			count++;
+			if (time_before(this_timer, next_timer))
 				next_timer = this_timer;
 		}
+		hlist_bl_unlock(head);
 	}
 
+	if (tun_flow_buckets(count) < t->mask + 1)
+		schedule_work(&tun->flow_resize_work);
 	if (count)
-		mod_timer(&tun->flow_gc_timer, round_jiffies_up(next_timer));
-	spin_unlock_bh(&tun->lock);
+		schedule_delayed_work(&tun->flow_gc_work,
+				      round_jiffies_relative(next_timer - jiffies));
+	mutex_unlock(&tun->flow_mutex);
+}
+
+/* Move the flows to a table sized for their current number. New flows go
+ * to the new table as soon as it is published; lookups may miss the ones
+ * not moved yet, which only makes those packets fall back to the hash
+ * based queue pick.
+ */
+static void tun_flow_resize(struct work_struct *work)
+{
+	struct tun_struct *tun = container_of(work, struct tun_struct,
+					      flow_resize_work);
+	struct tun_flow_table *old, *new;
+	u32 nbuckets, i;
+
+	mutex_lock(&tun->flow_mutex);
+	old = tun_flows_locked(tun);
+	nbuckets = tun_flow_buckets(atomic_read(&tun->flow_count));
+	if (nbuckets == old->mask + 1)
+		goto unlock;
+
+	new = tun_flow_table_alloc(nbuckets);
+	if (!new)
+		goto unlock;
+
+	tun_debug(KERN_INFO, tun, "resize flow table: %u to %u buckets\n",
+		  old->mask + 1, nbuckets);
+
+	rcu_assign_pointer(tun->flows, new);
+	/* Wait for tun_flow_update() to be done adding to the old table */
+	synchronize_rcu();
+
+	for (i = 0; i <= old->mask; i++) {
+		struct hlist_bl_head *head = &old->buckets[i];
+		struct tun_flow_entry *e;
+		struct hlist_bl_node *n, *tmp;
+
+		hlist_bl_lock(head);
+		hlist_bl_for_each_entry_safe(e, n, tmp, head, hash_link) {
+			struct hlist_bl_head *nhead = tun_flow_bucket(new,
+								      e->rxhash);
+
+			hlist_bl_lock(nhead);
+			if (tun_flow_find(nhead, e->rxhash)) {
+				/* Recreated in the new table meanwhile */
+				tun_flow_delete(tun, e);
+			} else {
+				hlist_bl_del_rcu(&e->hash_link);
+				hlist_bl_add_head_rcu(&e->hash_link, nhead);
+			}
+			hlist_bl_unlock(nhead);
+		}
+		hlist_bl_unlock(head);
+	}
+
+	synchronize_rcu();
+	tun_flow_table_free(old);
+unlock:
+	mutex_unlock(&tun->flow_mutex);
 }
 
 static void tun_flow_update(struct tun_struct *tun, u32 rxhash,
 			    struct tun_file *tfile)
 {
-	struct hlist_head *head;
+	struct tun_flow_table *t;
+	struct hlist_bl_head *head;
 	struct tun_flow_entry *e;
-	unsigned long delay = tun->ageing_time;
+	unsigned long delay = ACCESS_ONCE(tun->ageing_time);
 	u16 queue_index = tfile->queue_index;
 
 	if (!rxhash)
 		return;
-	else
-		head = &tun->flows[tun_hashfn(rxhash)];
 
 	rcu_read_lock();
 
@@ -327,6 +565,8 @@ static void tun_flow_update(struct tun_struct *tun, u32 rxhash,
 	if (tun->numqueues == 1 || tfile->detached)
 		goto unlock;
 
+	t = rcu_dereference(tun->flows);
+	head = tun_flow_bucket(t, rxhash);
 	e = tun_flow_find(head, rxhash);
 	if (likely(e)) {
 		/* TODO: keep queueing to old queue until it's empty? */
@@ -334,15 +574,17 @@ static void tun_flow_update(struct tun_struct *tun, u32 rxhash,
 		e->updated = jiffies;
 		sock_rps_record_flow_hash(e->rps_rxhash);
 	} else {
-		spin_lock_bh(&tun->lock);
+		hlist_bl_lock(head);
 		if (!tun_flow_find(head, rxhash) &&
-		    tun->flow_count < MAX_TAP_FLOWS)
+		    atomic_read(&tun->flow_count) < ACCESS_ONCE(tun->max_flows))
 			tun_flow_create(tun, head, rxhash, queue_index);
+		hlist_bl_unlock(head);
 
-		if (!timer_pending(&tun->flow_gc_timer))
-			mod_timer(&tun->flow_gc_timer,
-				  round_jiffies_up(jiffies + delay));
-		spin_unlock_bh(&tun->lock);
+		if (tun_flow_buckets(atomic_read(&tun->flow_count)) >
+		    t->mask + 1)
+			schedule_work(&tun->flow_resize_work);
+		schedule_delayed_work(&tun->flow_gc_work,
+				      round_jiffies_relative(delay));
 	}
 
 unlock:
@@ -372,6 +614,7 @@ static u16 tun_select_queue(struct net_device *dev, struct sk_buff *skb,
 			    void *accel_priv, select_queue_fallback_t fallback)
 {
 	struct tun_struct *tun = netdev_priv(dev);
+	struct sk_filter *steering;
 	struct tun_flow_entry *e;
 	u32 txq = 0;
 	u32 numqueues = 0;
@@ -379,9 +622,16 @@ static u16 tun_select_queue(struct net_device *dev, struct sk_buff *skb,
 	rcu_read_lock();
 	numqueues = ACCESS_ONCE(tun->numqueues);
 
+	/* A steering program, if set, has the final say */
+	steering = rcu_dereference(tun->steering_filter);
+	if (steering && numqueues) {
+		txq = SK_RUN_FILTER(steering, skb) % numqueues;
+		goto unlock;
+	}
+
 	txq = skb_get_hash(skb);
 	if (txq) {
-		e = tun_flow_find(&tun->flows[tun_hashfn(txq)], txq);
+		e = tun_flow_lookup(tun, txq);
 		if (e) {
 			tun_flow_save_rps_rxhash(e, txq);
 			txq = e->queue_index;
@@ -394,6 +644,7 @@ static u16 tun_select_queue(struct net_device *dev, struct sk_buff *skb,
 			txq -= numqueues;
 	}
 
+unlock:
 	rcu_read_unlock();
 	return txq;
 }
@@ -435,6 +686,71 @@ static void tun_queue_purge(struct tun_file *tfile)
 {
 	skb_queue_purge(&tfile->sk.sk_receive_queue);
 	skb_queue_purge(&tfile->sk.sk_error_queue);
+	skb_queue_purge(&tfile->sk.sk_write_queue);
+}
+
+/* With IFF_NAPI, tun_get_user() queues frames on sk_write_queue and this
+ * feeds them to GRO from softirq context.
+ */
+static int tun_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct tun_file *tfile = container_of(napi, struct tun_file, napi);
+	struct sk_buff_head *queue = &tfile->sk.sk_write_queue;
+	struct sk_buff_head process_queue;
+	struct sk_buff *skb;
+	int received = 0;
+
+	__skb_queue_head_init(&process_queue);
+
+	spin_lock(&queue->lock);
+	skb_queue_splice_tail_init(queue, &process_queue);
+	spin_unlock(&queue->lock);
+
+	while (received < budget && (skb = __skb_dequeue(&process_queue))) {
+		napi_gro_receive(napi, skb);
+		++received;
+	}
+
+	if (!skb_queue_empty(&process_queue)) {
+		spin_lock(&queue->lock);
+		skb_queue_splice(&process_queue, queue);
+		spin_unlock(&queue->lock);
+	}
+
+	if (received < budget) {
+		napi_complete(napi);
+		/* No NAPI_STATE_MISSED here: a frame queued while we were
+		 * still scheduled did not reschedule us, pick it up now.
+		 */
+		if (!skb_queue_empty(queue))
+			napi_schedule(napi);
+	}
+
+	return received;
+}
+
+static void tun_napi_init(struct tun_struct *tun, struct tun_file *tfile,
+			  bool napi_en)
+{
+	tfile->napi_enabled = napi_en;
+	if (napi_en) {
+		netif_napi_add(tun->dev, &tfile->napi, tun_napi_poll,
+			       NAPI_POLL_WEIGHT);
+		napi_enable(&tfile->napi);
+	}
+}
+
+static void tun_napi_disable(struct tun_file *tfile)
+{
+	if (tfile->napi_enabled)
+		napi_disable(&tfile->napi);
+}
+
+static void tun_napi_del(struct tun_file *tfile)
+{
+	if (tfile->napi_enabled)
+		netif_napi_del(&tfile->napi);
+	tfile->napi_enabled = false;
 }
 
 static void __tun_detach(struct tun_file *tfile, bool clean)
@@ -444,6 +760,11 @@ static void __tun_detach(struct tun_file *tfile, bool clean)
 
 	tun = rtnl_dereference(tfile->tun);
 
+	if (tun && clean) {
+		tun_napi_disable(tfile);
+		tun_napi_del(tfile);
+	}
+
 	if (tun && !tfile->detached) {
 		u16 index = tfile->queue_index;
 		BUG_ON(index >= tun->numqueues);
@@ -501,11 +822,13 @@ static void tun_detach_all(struct net_device *dev)
 	for (i = 0; i < n; i++) {
 		tfile = rtnl_dereference(tun->tfiles[i]);
 		BUG_ON(!tfile);
+		tun_napi_disable(tfile);
 		tfile->socket.sk->sk_data_ready(tfile->socket.sk);
 		RCU_INIT_POINTER(tfile->tun, NULL);
 		--tun->numqueues;
 	}
 	list_for_each_entry(tfile, &tun->disabled, next) {
+		tun_napi_disable(tfile);
 		tfile->socket.sk->sk_data_ready(tfile->socket.sk);
 		RCU_INIT_POINTER(tfile->tun, NULL);
 	}
@@ -514,12 +837,14 @@ static void tun_detach_all(struct net_device *dev)
 	synchronize_net();
 	for (i = 0; i < n; i++) {
 		tfile = rtnl_dereference(tun->tfiles[i]);
+		tun_napi_del(tfile);
 		/* Drop read queue */
 		tun_queue_purge(tfile);
 		sock_put(&tfile->sk);
 	}
 	list_for_each_entry_safe(tfile, tmp, &tun->disabled, next) {
 		tun_enable_queue(tfile);
+		tun_napi_del(tfile);
 		tun_queue_purge(tfile);
 		sock_put(&tfile->sk);
 	}
@@ -529,7 +854,8 @@ static void tun_detach_all(struct net_device *dev)
 		module_put(THIS_MODULE);
 }
 
-static int tun_attach(struct tun_struct *tun, struct file *file, bool skip_filter)
+static int tun_attach(struct tun_struct *tun, struct file *file,
+		      bool skip_filter, bool napi)
 {
 	struct tun_file *tfile = file->private_data;
 	int err;
@@ -565,10 +891,12 @@ static int tun_attach(struct tun_struct *tun, struct file *file, bool skip_filte
 	rcu_assign_pointer(tun->tfiles[tun->numqueues], tfile);
 	tun->numqueues++;
 
-	if (tfile->detached)
+	if (tfile->detached) {
 		tun_enable_queue(tfile);
-	else
+	} else {
 		sock_hold(&tfile->sk);
+		tun_napi_init(tun, tfile, napi);
+	}
 
 	tun_set_real_num_queues(tun);
 
@@ -716,6 +1044,8 @@ static int check_filter(struct tap_filter *filter, const struct sk_buff *skb)
 /* Network device part of the driver */
 
 static const struct ethtool_ops tun_ethtool_ops;
+static int tun_ring_rx(struct tun_struct *tun, struct tun_file *tfile,
+		       struct tun_ring *ring, struct sk_buff *skb);
 
 /* Net device detach from fd. */
 static void tun_net_uninit(struct net_device *dev)
@@ -743,13 +1073,17 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	struct tun_struct *tun = netdev_priv(dev);
 	int txq = skb->queue_mapping;
 	struct tun_file *tfile;
+	struct tun_ring *ring;
 	u32 numqueues = 0;
+	enum tun_drop_reason why;
+	int err;
 
 	rcu_read_lock();
 	tfile = rcu_dereference(tun->tfiles[txq]);
 	numqueues = ACCESS_ONCE(tun->numqueues);
 
 	/* Drop packet if interface is not attached */
+	why = TUN_DROP_TX_DETACHED;
 	if (txq >= numqueues)
 		goto drop;
 
@@ -762,8 +1096,7 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 		rxhash = skb_get_hash(skb);
 		if (rxhash) {
 			struct tun_flow_entry *e;
-			e = tun_flow_find(&tun->flows[tun_hashfn(rxhash)],
-					rxhash);
+			e = tun_flow_lookup(tun, rxhash);
 			if (e)
 				tun_flow_save_rps_rxhash(e, rxhash);
 		}
@@ -776,6 +1109,7 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	/* Drop if the filter does not like it.
 	 * This is a noop if the filter is disabled.
 	 * Filter can be enabled only for the TAP devices. */
+	why = TUN_DROP_TX_FILTER;
 	if (!check_filter(&tun->txflt, skb))
 		goto drop;
 
@@ -783,13 +1117,28 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	    sk_filter(tfile->socket.sk, skb))
 		goto drop;
 
+	/* With a ring set up the packet is copied out right here */
+	ring = rcu_dereference(tfile->ring);
+	if (ring && ring->rx_frame_nr) {
+		err = tun_ring_rx(tun, tfile, ring, skb);
+		if (err) {
+			why = err == -ENOBUFS ? TUN_DROP_TX_QUEUE_FULL :
+						TUN_DROP_TX_HDR;
+			goto drop;
+		}
+		consume_skb(skb);
+		goto wake;
+	}
+
 	/* Limit the number of packets queued by dividing txq length with the
 	 * number of queues.
 	 */
+	why = TUN_DROP_TX_QUEUE_FULL;
 	if (skb_queue_len(&tfile->socket.sk->sk_receive_queue) * numqueues
 			  >= dev->tx_queue_len)
 		goto drop;
 
+	why = TUN_DROP_TX_FRAGS;
 	if (unlikely(skb_orphan_frags(skb, GFP_ATOMIC)))
 		goto drop;
 
@@ -808,6 +1157,7 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	/* Enqueue packet */
 	skb_queue_tail(&tfile->socket.sk->sk_receive_queue, skb);
 
+wake:
 	/* Notify and wake up reader process */
 	if (tfile->flags & TUN_FASYNC)
 		kill_fasync(&tfile->fasync, SIGIO, POLL_IN);
@@ -817,13 +1167,52 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	return NETDEV_TX_OK;
 
 drop:
-	dev->stats.tx_dropped++;
+	tun_drop(tun, why);
 	skb_tx_error(skb);
 	kfree_skb(skb);
 	rcu_read_unlock();
 	return NETDEV_TX_OK;
 }
 
+static struct rtnl_link_stats64 *
+tun_net_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats)
+{
+	struct tun_struct *tun = netdev_priv(dev);
+	struct tun_pcpu_stats *p;
+	u32 rx_dropped = 0, tx_dropped = 0, rx_frame_errors = 0;
+	int i, j;
+
+	for_each_possible_cpu(i) {
+		u64 rxpackets, rxbytes, txpackets, txbytes;
+		unsigned int start;
+
+		p = per_cpu_ptr(tun->pcpu_stats, i);
+		do {
+			start = u64_stats_fetch_begin_irq(&p->syncp);
+			rxpackets	= p->rx_packets;
+			rxbytes		= p->rx_bytes;
+			txpackets	= p->tx_packets;
+			txbytes		= p->tx_bytes;
+		} while (u64_stats_fetch_retry_irq(&p->syncp, start));
+
+		stats->rx_packets	+= rxpackets;
+		stats->rx_bytes		+= rxbytes;
+		stats->tx_packets	+= txpackets;
+		stats->tx_bytes		+= txbytes;
+
+		/* u32 counters */
+		rx_frame_errors	+= p->rx_frame_errors;
+		for (j = 0; j < TUN_DROP_RX_FIRST; j++)
+			tx_dropped += p->drops[j];
+		for (; j < TUN_DROP_MAX; j++)
+			rx_dropped += p->drops[j];
+	}
+	stats->rx_dropped  = rx_dropped;
+	stats->rx_frame_errors = rx_frame_errors;
+	stats->tx_dropped = tx_dropped;
+	return stats;
+}
+
 static void tun_net_mclist(struct net_device *dev)
 {
 	/*
@@ -887,6 +1276,7 @@ static const struct net_device_ops tun_netdev_ops = {
 	.ndo_change_mtu		= tun_net_change_mtu,
 	.ndo_fix_features	= tun_net_fix_features,
 	.ndo_select_queue	= tun_select_queue,
+	.ndo_get_stats64	= tun_net_get_stats64,
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	.ndo_poll_controller	= tun_poll_controller,
 #endif
@@ -903,29 +1293,57 @@ static const struct net_device_ops tap_netdev_ops = {
 	.ndo_set_mac_address	= eth_mac_addr,
 	.ndo_validate_addr	= eth_validate_addr,
 	.ndo_select_queue	= tun_select_queue,
+	.ndo_get_stats64	= tun_net_get_stats64,
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	.ndo_poll_controller	= tun_poll_controller,
 #endif
 	.ndo_change_carrier	= tun_change_carrier,
 };
 
-static void tun_flow_init(struct tun_struct *tun)
+static int tun_flow_init(struct tun_struct *tun)
 {
-	int i;
+	struct tun_flow_table *t;
 
-	for (i = 0; i < TUN_NUM_FLOW_ENTRIES; i++)
-		INIT_HLIST_HEAD(&tun->flows[i]);
+	t = tun_flow_table_alloc(TUN_FLOW_MIN_BUCKETS);
+	if (!t)
+		return -ENOMEM;
+	RCU_INIT_POINTER(tun->flows, t);
+	mutex_init(&tun->flow_mutex);
+	atomic_set(&tun->flow_count, 0);
 
 	tun->ageing_time = TUN_FLOW_EXPIRE;
-	setup_timer(&tun->flow_gc_timer, tun_flow_cleanup, (unsigned long)tun);
-	mod_timer(&tun->flow_gc_timer,
-		  round_jiffies_up(jiffies + tun->ageing_time));
+	tun->max_flows = MAX_TAP_FLOWS;
+	INIT_DELAYED_WORK(&tun->flow_gc_work, tun_flow_cleanup);
+	INIT_WORK(&tun->flow_resize_work, tun_flow_resize);
+	schedule_delayed_work(&tun->flow_gc_work,
+			      round_jiffies_relative(tun->ageing_time));
+	return 0;
 }
 
 static void tun_flow_uninit(struct tun_struct *tun)
 {
-	del_timer_sync(&tun->flow_gc_timer);
+	cancel_delayed_work_sync(&tun->flow_gc_work);
+	cancel_work_sync(&tun->flow_resize_work);
 	tun_flow_flush(tun);
+	/* Entries are freed after a grace period, the table right away */
+	tun_flow_table_free(rcu_dereference_protected(tun->flows, 1));
+}
+
+static int tun_set_flow_cfg(struct tun_struct *tun, void __user *argp)
+{
+	struct tun_flow_cfg cfg;
+
+	if (copy_from_user(&cfg, argp, sizeof(cfg)))
+		return -EFAULT;
+	if (!cfg.ageing_ms || !cfg.max_flows || cfg.max_flows > TUN_FLOWS_MAX)
+		return -EINVAL;
+
+	ACCESS_ONCE(tun->ageing_time) = msecs_to_jiffies(cfg.ageing_ms);
+	ACCESS_ONCE(tun->max_flows) = cfg.max_flows;
+	/* Apply the new ageing time right away */
+	mod_delayed_work(system_wq, &tun->flow_gc_work, 0);
+
+	return 0;
 }
 
 /* Initialize net device. */
@@ -965,6 +1383,31 @@ static void tun_net_init(struct net_device *dev)
 /* Character device part */
 
 /* Poll */
+static inline struct tun_ring_hdr *tun_ring_frame(struct tun_ring *ring,
+						  u32 index)
+{
+	return ring->buf + (size_t)index * ring->frame_size;
+}
+
+/* Has the last rx frame filled not been given back yet? */
+static bool tun_ring_readable(struct tun_file *tfile)
+{
+	struct tun_ring *ring;
+	struct tun_ring_hdr *hdr;
+	bool ret = false;
+
+	rcu_read_lock();
+	ring = rcu_dereference(tfile->ring);
+	if (ring && ring->rx_frame_nr) {
+		hdr = tun_ring_frame(ring, (ACCESS_ONCE(ring->rx_head) +
+					    ring->rx_frame_nr - 1) %
+					   ring->rx_frame_nr);
+		ret = ACCESS_ONCE(hdr->status) == TUN_RING_USER;
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
 static unsigned int tun_chr_poll(struct file *file, poll_table *wait)
 {
 	struct tun_file *tfile = file->private_data;
@@ -981,7 +1424,7 @@ static unsigned int tun_chr_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, sk_sleep(sk), wait);
 
-	if (!skb_queue_empty(&sk->sk_receive_queue))
+	if (!skb_queue_empty(&sk->sk_receive_queue) || tun_ring_readable(tfile))
 		mask |= POLLIN | POLLRDNORM;
 
 	if (sock_writeable(sk) ||
@@ -1023,10 +1466,246 @@ static struct sk_buff *tun_alloc_skb(struct tun_file *tfile,
 	return skb;
 }
 
-/* Get packet from user space buffer */
+static bool tun_police(struct tun_policer *p)
+{
+	u64 now, tokens;
+	bool pass;
+
+	spin_lock(&p->lock);
+	if (!p->cost) {
+		spin_unlock(&p->lock);
+		return true;
+	}
+	now = ktime_to_ns(ktime_get());
+	tokens = min(p->tokens + now - p->last, p->depth);
+	p->last = now;
+	pass = tokens >= p->cost;
+	if (pass)
+		tokens -= p->cost;
+	p->tokens = tokens;
+	spin_unlock(&p->lock);
+
+	return pass;
+}
+
+/* Run the injection filter on the first peek bytes (at most TUN_INJ_PEEK)
+ * of a frame being written, before anything is allocated for it. Returns
+ * true if the frame is to be dropped.
+ */
+static bool tun_inj_filter_drop(struct tun_struct *tun, __be16 proto,
+				const u8 *head, size_t peek)
+{
+	struct sk_filter *filter;
+	struct sk_buff *skb;
+	u32 verdict = 1;
+
+	switch (tun->flags & TUN_TYPE_MASK) {
+	case TUN_TUN_DEV:
+		if (tun->flags & TUN_NO_PI && peek)
+			proto = (head[0] & 0xf0) == 0x60 ? htons(ETH_P_IPV6) :
+							   htons(ETH_P_IP);
+		break;
+	case TUN_TAP_DEV:
+		proto = ((const struct ethhdr *)head)->h_proto;
+		break;
+	}
+
+	rcu_read_lock();
+	filter = rcu_dereference(tun->inj_filter);
+	if (filter) {
+		skb = get_cpu_var(tun_inj_skb);
+		skb->data = skb->head;
+		skb_reset_tail_pointer(skb);
+		skb->len = 0;
+		memcpy(skb_put(skb, peek), head, peek);
+		skb_reset_mac_header(skb);
+		skb_reset_network_header(skb);
+		skb_clear_hash(skb);
+		skb->protocol = proto;
+		skb->dev = tun->dev;
+
+		verdict = SK_RUN_FILTER(filter, skb);
+		put_cpu_var(tun_inj_skb);
+	}
+	rcu_read_unlock();
+
+	if (!verdict) {
+		tun_drop(tun, TUN_DROP_RX_FILTER);
+		return true;
+	}
+	if ((verdict & TUN_INJ_POLICE_FLAG) &&
+	    (verdict & ~TUN_INJ_POLICE_FLAG) < TUN_INJ_POLICERS &&
+	    !tun_police(&tun->inj_policers[verdict & ~TUN_INJ_POLICE_FLAG])) {
+		tun_drop(tun, TUN_DROP_RX_POLICED);
+		return true;
+	}
+	return false;
+}
+
+/* Hand a batch of skbs queued by tun_get_user() to the stack. Running them
+ * back to back with bottom halves disabled costs one softirq pass for the
+ * whole batch instead of one netif_rx_ni() per frame.
+ */
+static void tun_rx_batched(struct sk_buff_head *queue)
+{
+	struct sk_buff *skb;
+
+	if (skb_queue_empty(queue))
+		return;
+
+	local_bh_disable();
+	while ((skb = __skb_dequeue(queue)))
+		netif_receive_skb(skb);
+	local_bh_enable();
+}
+
+/* Check the vnet header of a frame being written, len being the length of
+ * the packet that follows it. The header is zero without IFF_VNET_HDR.
+ */
+static int tun_check_hdrs(struct tun_struct *tun, struct virtio_net_hdr *gso,
+			  size_t len)
+{
+	if ((gso->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+	    gso->csum_start + gso->csum_offset + 2 > gso->hdr_len)
+		gso->hdr_len = gso->csum_start + gso->csum_offset + 2;
+
+	if (gso->hdr_len > len)
+		return -EINVAL;
+
+	if ((tun->flags & TUN_TYPE_MASK) == TUN_TAP_DEV &&
+	    unlikely(len < ETH_HLEN ||
+		     (gso->hdr_len && gso->hdr_len < ETH_HLEN)))
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Finish a packet written to the device, once its len bytes are in skb, and
+ * pass it up, or queue it for tun_rx_batched() if queue is set. uarg is the
+ * vhost zerocopy state if the skb maps user pages; it is only attached to
+ * the skb once nothing can fail any more. Frees skb on error.
+ */
+static int tun_rx_skb(struct tun_struct *tun, struct tun_file *tfile,
+		      struct sk_buff *skb, struct tun_pi *pi,
+		      const struct virtio_net_hdr *gso, size_t len,
+		      struct ubuf_info *uarg, struct sk_buff_head *queue)
+{
+	struct tun_pcpu_stats *stats;
+	u32 rxhash;
+
+	if (gso->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		if (!skb_partial_csum_set(skb, gso->csum_start,
+					  gso->csum_offset)) {
+			this_cpu_inc(tun->pcpu_stats->rx_frame_errors);
+			kfree_skb(skb);
+			return -EINVAL;
+		}
+	}
+
+	switch (tun->flags & TUN_TYPE_MASK) {
+	case TUN_TUN_DEV:
+		if (tun->flags & TUN_NO_PI) {
+			switch (skb->data[0] & 0xf0) {
+			case 0x40:
+				pi->proto = htons(ETH_P_IP);
+				break;
+			case 0x60:
+				pi->proto = htons(ETH_P_IPV6);
+				break;
+			default:
+				tun_drop(tun, TUN_DROP_RX_PROTO);
+				kfree_skb(skb);
+				return -EINVAL;
+			}
+		}
+
+		skb_reset_mac_header(skb);
+		skb->protocol = pi->proto;
+		skb->dev = tun->dev;
+		break;
+	case TUN_TAP_DEV:
+		skb->protocol = eth_type_trans(skb, tun->dev);
+		break;
+	}
+
+	skb_reset_network_header(skb);
+
+	if (gso->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+		pr_debug("GSO!\n");
+		switch (gso->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+		case VIRTIO_NET_HDR_GSO_TCPV4:
+			skb_shinfo(skb)->gso_type = SKB_GSO_TCPV4;
+			break;
+		case VIRTIO_NET_HDR_GSO_TCPV6:
+			skb_shinfo(skb)->gso_type = SKB_GSO_TCPV6;
+			break;
+		case VIRTIO_NET_HDR_GSO_UDP:
+			skb_shinfo(skb)->gso_type = SKB_GSO_UDP;
+			if (skb->protocol == htons(ETH_P_IPV6))
+				ipv6_proxy_select_ident(skb);
+			break;
+		default:
+			this_cpu_inc(tun->pcpu_stats->rx_frame_errors);
+			kfree_skb(skb);
+			return -EINVAL;
+		}
+
+		if (gso->gso_type & VIRTIO_NET_HDR_GSO_ECN)
+			skb_shinfo(skb)->gso_type |= SKB_GSO_TCP_ECN;
+
+		skb_shinfo(skb)->gso_size = gso->gso_size;
+		if (skb_shinfo(skb)->gso_size == 0) {
+			this_cpu_inc(tun->pcpu_stats->rx_frame_errors);
+			kfree_skb(skb);
+			return -EINVAL;
+		}
+
+		/* Header must be checked, and gso_segs computed. */
+		skb_shinfo(skb)->gso_type |= SKB_GSO_DODGY;
+		skb_shinfo(skb)->gso_segs = 0;
+	}
+
+	/* copy skb_ubuf_info for callback when skb has no error */
+	if (uarg) {
+		skb_shinfo(skb)->destructor_arg = uarg;
+		skb_shinfo(skb)->tx_flags |= SKBTX_DEV_ZEROCOPY;
+		skb_shinfo(skb)->tx_flags |= SKBTX_SHARED_FRAG;
+	}
+
+	skb_probe_transport_header(skb, 0);
+
+	rxhash = skb_get_hash(skb);
+	if (tfile->napi_enabled) {
+		struct sk_buff_head *napi_queue = &tfile->sk.sk_write_queue;
+
+		spin_lock_bh(&napi_queue->lock);
+		__skb_queue_tail(napi_queue, skb);
+		spin_unlock(&napi_queue->lock);
+		napi_schedule(&tfile->napi);
+		local_bh_enable();
+	} else if (queue)
+		__skb_queue_tail(queue, skb);
+	else
+		netif_rx_ni(skb);
+
+	stats = get_cpu_ptr(tun->pcpu_stats);
+	u64_stats_update_begin(&stats->syncp);
+	stats->rx_packets++;
+	stats->rx_bytes += len;
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(stats);
+
+	tun_flow_update(tun, rxhash, tfile);
+	return 0;
+}
+
+/* Get packet from user space buffer. If queue is set, the skb is queued
+ * there for tun_rx_batched() instead of being passed up right away.
+ */
 static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 			    void *msg_control, const struct iovec *iv,
-			    size_t total_len, size_t count, int noblock)
+			    size_t total_len, size_t count, int noblock,
+			    struct sk_buff_head *queue)
 {
 	struct tun_pi pi = { 0, cpu_to_be16(ETH_P_IP) };
 	struct sk_buff *skb;
@@ -1037,7 +1716,6 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 	int copylen;
 	bool zerocopy = false;
 	int err;
-	u32 rxhash;
 
 	if (!(tun->flags & TUN_NO_PI)) {
 		if (len < sizeof(pi))
@@ -1056,21 +1734,29 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 
 		if (memcpy_fromiovecend((void *)&gso, iv, offset, sizeof(gso)))
 			return -EFAULT;
-
-		if ((gso.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
-		    gso.csum_start + gso.csum_offset + 2 > gso.hdr_len)
-			gso.hdr_len = gso.csum_start + gso.csum_offset + 2;
-
-		if (gso.hdr_len > len)
-			return -EINVAL;
 		offset += tun->vnet_hdr_sz;
 	}
 
-	if ((tun->flags & TUN_TYPE_MASK) == TUN_TAP_DEV) {
+	err = tun_check_hdrs(tun, &gso, len);
+	if (err)
+		return err;
+	if ((tun->flags & TUN_TYPE_MASK) == TUN_TAP_DEV)
 		align += NET_IP_ALIGN;
-		if (unlikely(len < ETH_HLEN ||
-			     (gso.hdr_len && gso.hdr_len < ETH_HLEN)))
-			return -EINVAL;
+
+	if (rcu_access_pointer(tun->inj_filter)) {
+		u8 head[TUN_INJ_PEEK];
+		size_t peek = min_t(size_t, len, TUN_INJ_PEEK);
+
+		/* A fault is reported by the copy below */
+		if (!memcpy_fromiovecend(head, iv, offset, peek) &&
+		    tun_inj_filter_drop(tun, pi.proto, head, peek)) {
+			/* Reported as sent, so vhost is done with the buffer */
+			if (msg_control) {
+				struct ubuf_info *uarg = msg_control;
+				uarg->callback(uarg, false);
+			}
+			return total_len;
+		}
 	}
 
 	good_linear = SKB_MAX_HEAD(align);
@@ -1099,7 +1785,7 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 	skb = tun_alloc_skb(tfile, align, copylen, linear, noblock);
 	if (IS_ERR(skb)) {
 		if (PTR_ERR(skb) != -EAGAIN)
-			tun->dev->stats.rx_dropped++;
+			tun_drop(tun, TUN_DROP_RX_NOMEM);
 		return PTR_ERR(skb);
 	}
 
@@ -1114,100 +1800,69 @@ static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 	}
 
 	if (err) {
-		tun->dev->stats.rx_dropped++;
+		tun_drop(tun, TUN_DROP_RX_FAULT);
 		kfree_skb(skb);
 		return -EFAULT;
 	}
 
-	if (gso.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
-		if (!skb_partial_csum_set(skb, gso.csum_start,
-					  gso.csum_offset)) {
-			tun->dev->stats.rx_frame_errors++;
-			kfree_skb(skb);
-			return -EINVAL;
-		}
-	}
-
-	switch (tun->flags & TUN_TYPE_MASK) {
-	case TUN_TUN_DEV:
-		if (tun->flags & TUN_NO_PI) {
-			switch (skb->data[0] & 0xf0) {
-			case 0x40:
-				pi.proto = htons(ETH_P_IP);
-				break;
-			case 0x60:
-				pi.proto = htons(ETH_P_IPV6);
-				break;
-			default:
-				tun->dev->stats.rx_dropped++;
-				kfree_skb(skb);
-				return -EINVAL;
-			}
-		}
-
-		skb_reset_mac_header(skb);
-		skb->protocol = pi.proto;
-		skb->dev = tun->dev;
-		break;
-	case TUN_TAP_DEV:
-		skb->protocol = eth_type_trans(skb, tun->dev);
-		break;
-	}
-
-	skb_reset_network_header(skb);
-
-	if (gso.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
-		pr_debug("GSO!\n");
-		switch (gso.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
-		case VIRTIO_NET_HDR_GSO_TCPV4:
-			skb_shinfo(skb)->gso_type = SKB_GSO_TCPV4;
-			break;
-		case VIRTIO_NET_HDR_GSO_TCPV6:
-			skb_shinfo(skb)->gso_type = SKB_GSO_TCPV6;
-			break;
-		case VIRTIO_NET_HDR_GSO_UDP:
-			skb_shinfo(skb)->gso_type = SKB_GSO_UDP;
-			if (skb->protocol == htons(ETH_P_IPV6))
-				ipv6_proxy_select_ident(skb);
-			break;
-		default:
-			tun->dev->stats.rx_frame_errors++;
-			kfree_skb(skb);
-			return -EINVAL;
-		}
+	err = tun_rx_skb(tun, tfile, skb, &pi, &gso, len,
+			 zerocopy ? msg_control : NULL, queue);
+	return err ? err : total_len;
+}
 
-		if (gso.gso_type & VIRTIO_NET_HDR_GSO_ECN)
-			skb_shinfo(skb)->gso_type |= SKB_GSO_TCP_ECN;
+/* Get a packet from a kernel buffer laid out as for write(), a tx ring
+ * frame. Same checks and delivery as tun_get_user(), with plain copies.
+ */
+static ssize_t tun_get_kern(struct tun_struct *tun, struct tun_file *tfile,
+			    const u8 *buf, size_t total_len,
+			    struct sk_buff_head *queue)
+{
+	struct tun_pi pi = { 0, cpu_to_be16(ETH_P_IP) };
+	struct virtio_net_hdr gso = { 0 };
+	size_t len = total_len;
+	struct sk_buff *skb;
+	int err;
 
-		skb_shinfo(skb)->gso_size = gso.gso_size;
-		if (skb_shinfo(skb)->gso_size == 0) {
-			tun->dev->stats.rx_frame_errors++;
-			kfree_skb(skb);
+	if (!(tun->flags & TUN_NO_PI)) {
+		if (len < sizeof(pi))
 			return -EINVAL;
-		}
-
-		/* Header must be checked, and gso_segs computed. */
-		skb_shinfo(skb)->gso_type |= SKB_GSO_DODGY;
-		skb_shinfo(skb)->gso_segs = 0;
+		memcpy(&pi, buf, sizeof(pi));
+		buf += sizeof(pi);
+		len -= sizeof(pi);
 	}
 
-	/* copy skb_ubuf_info for callback when skb has no error */
-	if (zerocopy) {
-		skb_shinfo(skb)->destructor_arg = msg_control;
-		skb_shinfo(skb)->tx_flags |= SKBTX_DEV_ZEROCOPY;
-		skb_shinfo(skb)->tx_flags |= SKBTX_SHARED_FRAG;
+	if (tun->flags & TUN_VNET_HDR) {
+		if (len < tun->vnet_hdr_sz)
+			return -EINVAL;
+		memcpy(&gso, buf, sizeof(gso));
+		buf += tun->vnet_hdr_sz;
+		len -= tun->vnet_hdr_sz;
 	}
 
-	skb_probe_transport_header(skb, 0);
+	err = tun_check_hdrs(tun, &gso, len);
+	if (err)
+		return err;
 
-	rxhash = skb_get_hash(skb);
-	netif_rx_ni(skb);
+	if ((tun->flags & TUN_TYPE_MASK) == TUN_TAP_DEV)
+		skb = __netdev_alloc_skb_ip_align(tun->dev, len, GFP_KERNEL);
+	else
+		skb = __netdev_alloc_skb(tun->dev, len, GFP_KERNEL);
+	if (!skb) {
+		tun_drop(tun, TUN_DROP_RX_NOMEM);
+		return -ENOMEM;
+	}
+	memcpy(skb_put(skb, len), buf, len);
 
-	tun->dev->stats.rx_packets++;
-	tun->dev->stats.rx_bytes += len;
+	/* The frame is still mapped by user space, filter the copy */
+	if (rcu_access_pointer(tun->inj_filter) &&
+	    tun_inj_filter_drop(tun, pi.proto, skb->data,
+				min_t(size_t, len, TUN_INJ_PEEK))) {
+		kfree_skb(skb);
+		return total_len;
+	}
 
-	tun_flow_update(tun, rxhash, tfile);
-	return total_len;
+	err = tun_rx_skb(tun, tfile, skb, &pi, &gso, len, NULL, queue);
+	return err ? err : total_len;
 }
 
 static ssize_t tun_chr_aio_write(struct kiocb *iocb, const struct iovec *iv,
@@ -1224,12 +1879,58 @@ static ssize_t tun_chr_aio_write(struct kiocb *iocb, const struct iovec *iv,
 	tun_debug(KERN_INFO, tun, "tun_chr_write %ld\n", count);
 
 	result = tun_get_user(tun, tfile, NULL, iv, iov_length(iv, count),
-			      count, file->f_flags & O_NONBLOCK);
+			      count, file->f_flags & O_NONBLOCK, NULL);
 
 	tun_put(tun);
 	return result;
 }
 
+/* Fill in the vnet header describing skb, sent with vlan_hlen bytes of
+ * vlan tag inserted after the MAC addresses.
+ */
+static int tun_vnet_hdr_from_skb(const struct sk_buff *skb,
+				 struct virtio_net_hdr *gso, int vlan_hlen)
+{
+	if (skb_is_gso(skb)) {
+		struct skb_shared_info *sinfo = skb_shinfo(skb);
+
+		/* This is a hint as to how much should be linear. */
+		gso->hdr_len = skb_headlen(skb);
+		gso->gso_size = sinfo->gso_size;
+		if (sinfo->gso_type & SKB_GSO_TCPV4)
+			gso->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+		else if (sinfo->gso_type & SKB_GSO_TCPV6)
+			gso->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+		else if (sinfo->gso_type & SKB_GSO_UDP)
+			gso->gso_type = VIRTIO_NET_HDR_GSO_UDP;
+		else {
+			pr_err("unexpected GSO type: "
+			       "0x%x, gso_size %d, hdr_len %d\n",
+			       sinfo->gso_type, gso->gso_size,
+			       gso->hdr_len);
+			print_hex_dump(KERN_ERR, "tun: ",
+				       DUMP_PREFIX_NONE,
+				       16, 1, skb->head,
+				       min((int)gso->hdr_len, 64), true);
+			WARN_ON_ONCE(1);
+			return -EINVAL;
+		}
+		if (sinfo->gso_type & SKB_GSO_TCP_ECN)
+			gso->gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+	} else
+		gso->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+	if (skb->ip_summed == CHECKSUM_PARTIAL) {
+		gso->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		gso->csum_start = skb_checksum_start_offset(skb) + vlan_hlen;
+		gso->csum_offset = skb->csum_offset;
+	} else if (skb->ip_summed == CHECKSUM_UNNECESSARY) {
+		gso->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+	} /* else everything is zero */
+
+	return 0;
+}
+
 /* Put packet to the user space buffer */
 static ssize_t tun_put_user(struct tun_struct *tun,
 			    struct tun_file *tfile,
@@ -1237,6 +1938,7 @@ static ssize_t tun_put_user(struct tun_struct *tun,
 			    const struct iovec *iv, int len)
 {
 	struct tun_pi pi = { 0, skb->protocol };
+	struct tun_pcpu_stats *stats;
 	ssize_t total = 0;
 	int vlan_offset = 0, copied;
 	int vlan_hlen = 0;
@@ -1260,46 +1962,14 @@ static ssize_t tun_put_user(struct tun_struct *tun,
 
 	if (tun->flags & TUN_VNET_HDR) {
 		struct virtio_net_hdr gso = { 0 }; /* no info leak */
+		int err;
+
 		if ((len -= tun->vnet_hdr_sz) < 0)
 			return -EINVAL;
 
-		if (skb_is_gso(skb)) {
-			struct skb_shared_info *sinfo = skb_shinfo(skb);
-
-			/* This is a hint as to how much should be linear. */
-			gso.hdr_len = skb_headlen(skb);
-			gso.gso_size = sinfo->gso_size;
-			if (sinfo->gso_type & SKB_GSO_TCPV4)
-				gso.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
-			else if (sinfo->gso_type & SKB_GSO_TCPV6)
-				gso.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
-			else if (sinfo->gso_type & SKB_GSO_UDP)
-				gso.gso_type = VIRTIO_NET_HDR_GSO_UDP;
-			else {
-				pr_err("unexpected GSO type: "
-				       "0x%x, gso_size %d, hdr_len %d\n",
-				       sinfo->gso_type, gso.gso_size,
-				       gso.hdr_len);
-				print_hex_dump(KERN_ERR, "tun: ",
-					       DUMP_PREFIX_NONE,
-					       16, 1, skb->head,
-					       min((int)gso.hdr_len, 64), true);
-				WARN_ON_ONCE(1);
-				return -EINVAL;
-			}
-			if (sinfo->gso_type & SKB_GSO_TCP_ECN)
-				gso.gso_type |= VIRTIO_NET_HDR_GSO_ECN;
-		} else
-			gso.gso_type = VIRTIO_NET_HDR_GSO_NONE;
-
-		if (skb->ip_summed == CHECKSUM_PARTIAL) {
-			gso.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
-			gso.csum_start = skb_checksum_start_offset(skb) +
-					 vlan_hlen;
-			gso.csum_offset = skb->csum_offset;
-		} else if (skb->ip_summed == CHECKSUM_UNNECESSARY) {
-			gso.flags = VIRTIO_NET_HDR_F_DATA_VALID;
-		} /* else everything is zero */
+		err = tun_vnet_hdr_from_skb(skb, &gso, vlan_hlen);
+		if (err)
+			return err;
 
 		if (unlikely(memcpy_toiovecend(iv, (void *)&gso, total,
 					       sizeof(gso))))
@@ -1340,8 +2010,14 @@ static ssize_t tun_put_user(struct tun_struct *tun,
 	skb_copy_datagram_const_iovec(skb, vlan_offset, iv, copied, len);
 
 done:
-	tun->dev->stats.tx_packets++;
-	tun->dev->stats.tx_bytes += len;
+	/* tun_ring_rx() updates the tx counters from softirq */
+	local_bh_disable();
+	stats = this_cpu_ptr(tun->pcpu_stats);
+	u64_stats_update_begin(&stats->syncp);
+	stats->tx_packets++;
+	stats->tx_bytes += len;
+	u64_stats_update_end(&stats->syncp);
+	local_bh_enable();
 
 	return total;
 }
@@ -1399,11 +2075,400 @@ out:
 	return ret;
 }
 
+/* TUNREADBATCH: drain up to batch.count frames in one call */
+static long tun_read_batch(struct file *file, struct tun_batch __user *argp)
+{
+	struct tun_file *tfile = file->private_data;
+	struct tun_batch_msg __user *umsg;
+	struct tun_batch_msg msg;
+	struct tun_batch batch;
+	struct tun_struct *tun;
+	struct iovec iov;
+	int noblock = file->f_flags & O_NONBLOCK;
+	ssize_t ret = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+	if (batch.flags || batch.count > TUN_BATCH_MAX)
+		return -EINVAL;
+
+	tun = __tun_get(tfile);
+	if (!tun)
+		return -EBADFD;
+
+	umsg = (struct tun_batch_msg __user *)(unsigned long)batch.msgs;
+	for (i = 0; i < batch.count; i++) {
+		if (copy_from_user(&msg, &umsg[i], sizeof(msg))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (!msg.len) {
+			ret = -EINVAL;
+			break;
+		}
+		iov.iov_base = (void __user *)(unsigned long)msg.buf;
+		iov.iov_len = msg.len;
+
+		/* Only the first frame may sleep */
+		ret = tun_do_read(tun, tfile, &iov, msg.len, noblock || i);
+		if (ret < 0)
+			break;
+		msg.len = min_t(ssize_t, ret, msg.len);
+		if (put_user(msg.len, &umsg[i].len)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+
+	tun_put(tun);
+	return i ? i : ret;
+}
+
+/* TUNWRITEBATCH: inject up to batch.count frames in one call */
+static long tun_write_batch(struct file *file, struct tun_batch __user *argp)
+{
+	struct tun_file *tfile = file->private_data;
+	struct tun_batch_msg __user *umsg;
+	struct sk_buff_head queue;
+	struct tun_batch_msg msg;
+	struct tun_batch batch;
+	struct tun_struct *tun;
+	struct iovec iov;
+	int noblock = file->f_flags & O_NONBLOCK;
+	ssize_t ret = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+	if (batch.flags || batch.count > TUN_BATCH_MAX)
+		return -EINVAL;
+
+	tun = __tun_get(tfile);
+	if (!tun)
+		return -EBADFD;
+
+	__skb_queue_head_init(&queue);
+	umsg = (struct tun_batch_msg __user *)(unsigned long)batch.msgs;
+	for (i = 0; i < batch.count; i++) {
+		if (copy_from_user(&msg, &umsg[i], sizeof(msg))) {
+			ret = -EFAULT;
+			break;
+		}
+		iov.iov_base = (void __user *)(unsigned long)msg.buf;
+		iov.iov_len = msg.len;
+
+		/* Only the first frame may sleep for send buffer space; the
+		 * queued ones hold on to theirs until they are delivered.
+		 */
+		ret = tun_get_user(tun, tfile, NULL, &iov, msg.len, 1,
+				   noblock || i, &queue);
+		if (ret < 0)
+			break;
+	}
+	tun_rx_batched(&queue);
+
+	tun_put(tun);
+	return i ? i : ret;
+}
+
+/* Copy a packet sent on the device into the next rx frame of the ring.
+ * Called from tun_net_xmit() with rcu_read_lock held. Returns -ENOBUFS if
+ * that frame is still owned by user space, -EINVAL if the headers do not
+ * fit or cannot be built.
+ */
+static int tun_ring_rx(struct tun_struct *tun, struct tun_file *tfile,
+		       struct tun_ring *ring, struct sk_buff *skb)
+{
+	struct tun_pi pi = { 0, skb->protocol };
+	size_t room = ring->frame_size - TUN_RING_HDRLEN;
+	int vlan_hlen = vlan_tx_tag_present(skb) ? VLAN_HLEN : 0;
+	size_t hlen = 0, len, copy, vlan_offset = 0;
+	struct tun_pcpu_stats *stats;
+	struct tun_ring_hdr *hdr;
+	u8 *p;
+	int ret = 0;
+
+	if (!(tun->flags & TUN_NO_PI))
+		hlen += sizeof(pi);
+	if (tun->flags & TUN_VNET_HDR)
+		hlen += tun->vnet_hdr_sz;
+	if (hlen > room)
+		return -EINVAL;
+	len = min_t(size_t, skb->len + vlan_hlen, room - hlen);
+
+	spin_lock(&ring->rx_lock);
+	hdr = tun_ring_frame(ring, ring->rx_head);
+	if (ACCESS_ONCE(hdr->status) != TUN_RING_KERNEL) {
+		spin_unlock(&ring->rx_lock);
+		return -ENOBUFS;
+	}
+	/* Write the frame only once user space is done with it */
+	smp_mb();
+
+	p = (u8 *)(hdr + 1);
+	if (!(tun->flags & TUN_NO_PI)) {
+		if (len < skb->len + vlan_hlen)
+			pi.flags |= TUN_PKT_STRIP;
+		memcpy(p, &pi, sizeof(pi));
+		p += sizeof(pi);
+	}
+
+	if (tun->flags & TUN_VNET_HDR) {
+		struct virtio_net_hdr gso = { 0 };
+
+		ret = tun_vnet_hdr_from_skb(skb, &gso, vlan_hlen);
+		if (ret)
+			goto out;
+		memcpy(p, &gso, sizeof(gso));
+		p += tun->vnet_hdr_sz;
+	}
+
+	copy = len;
+	if (vlan_hlen) {
+		struct {
+			__be16 h_vlan_proto;
+			__be16 h_vlan_TCI;
+		} veth;
+		size_t n;
+
+		veth.h_vlan_proto = skb->vlan_proto;
+		veth.h_vlan_TCI = htons(vlan_tx_tag_get(skb));
+
+		vlan_offset = offsetof(struct vlan_ethhdr, h_vlan_proto);
+
+		n = min(vlan_offset, copy);
+		skb_copy_bits(skb, 0, p, n);
+		p += n;
+		copy -= n;
+
+		n = min(sizeof(veth), copy);
+		memcpy(p, &veth, n);
+		p += n;
+		copy -= n;
+	}
+	skb_copy_bits(skb, vlan_offset, p, copy);
+
+	hdr->len = hlen + len;
+	smp_wmb();
+	hdr->status = TUN_RING_USER;
+	if (++ring->rx_head == ring->rx_frame_nr)
+		ring->rx_head = 0;
+out:
+	spin_unlock(&ring->rx_lock);
+	if (ret)
+		return ret;
+
+	stats = get_cpu_ptr(tun->pcpu_stats);
+	u64_stats_update_begin(&stats->syncp);
+	stats->tx_packets++;
+	stats->tx_bytes += len;
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(stats);
+
+	return 0;
+}
+
+/* TUNRINGSEND: inject all the tx frames user space has marked for sending */
+static long tun_ring_send(struct file *file)
+{
+	struct tun_file *tfile = file->private_data;
+	struct tun_ring_hdr *hdr;
+	struct sk_buff_head queue;
+	struct tun_struct *tun;
+	struct tun_ring *ring;
+	size_t room, len;
+	ssize_t ret;
+	long sent = 0;
+
+	tun = __tun_get(tfile);
+	if (!tun)
+		return -EBADFD;
+
+	/* Set up once and freed only on release, no need to hold rcu */
+	ring = rcu_dereference_raw(tfile->ring);
+	if (!ring) {
+		tun_put(tun);
+		return -EINVAL;
+	}
+
+	room = ring->frame_size - TUN_RING_HDRLEN;
+	__skb_queue_head_init(&queue);
+	mutex_lock(&ring->tx_mutex);
+	while (sent < ring->tx_frame_nr) {
+		hdr = tun_ring_frame(ring, ring->rx_frame_nr + ring->tx_head);
+		if (ACCESS_ONCE(hdr->status) != TUN_RING_SEND_REQUEST)
+			break;
+		smp_rmb();
+
+		len = ACCESS_ONCE(hdr->len);
+		if (len > room)
+			ret = -EINVAL;
+		else
+			ret = tun_get_kern(tun, tfile, (const u8 *)(hdr + 1),
+					   len, &queue);
+
+		smp_mb();
+		hdr->status = ret < 0 ? TUN_RING_WRONG_FORMAT :
+					TUN_RING_AVAILABLE;
+		if (++ring->tx_head == ring->tx_frame_nr)
+			ring->tx_head = 0;
+		sent++;
+
+		if (skb_queue_len(&queue) >= TUN_BATCH_MAX)
+			tun_rx_batched(&queue);
+	}
+	tun_rx_batched(&queue);
+	mutex_unlock(&ring->tx_mutex);
+
+	tun_put(tun);
+	return sent;
+}
+
+static int tun_set_ring(struct tun_file *tfile, void __user *argp)
+{
+	struct tun_ring_req req;
+	struct tun_ring *ring;
+	u64 size;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.flags ||
+	    req.frame_size <= TUN_RING_HDRLEN ||
+	    req.frame_size % TUN_RING_ALIGNMENT ||
+	    !(req.rx_frame_nr + (u64)req.tx_frame_nr))
+		return -EINVAL;
+
+	size = (u64)req.frame_size * (req.rx_frame_nr + (u64)req.tx_frame_nr);
+	if (size > TUN_RING_MAX_SIZE)
+		return -EINVAL;
+
+	if (rtnl_dereference(tfile->ring))
+		return -EBUSY;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->size = PAGE_ALIGN(size);
+	ring->buf = vmalloc_user(ring->size);
+	if (!ring->buf) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	ring->frame_size = req.frame_size;
+	ring->rx_frame_nr = req.rx_frame_nr;
+	ring->tx_frame_nr = req.tx_frame_nr;
+	spin_lock_init(&ring->rx_lock);
+	mutex_init(&ring->tx_mutex);
+
+	rcu_assign_pointer(tfile->ring, ring);
+	return 0;
+}
+
+static void tun_free_ring(struct tun_ring *ring)
+{
+	if (!ring)
+		return;
+	vfree(ring->buf);
+	kfree(ring);
+}
+
+static int tun_chr_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct tun_file *tfile = file->private_data;
+	struct tun_ring *ring = rcu_dereference_raw(tfile->ring);
+
+	if (!ring)
+		return -EINVAL;
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->buf, 0);
+}
+
+/* Replace the program in *slot with the one in the user sock_fprog at
+ * argp, or remove it for an empty one. Called under rtnl_lock. Programs
+ * are run under rcu_read_lock only: the injection filter in the write
+ * paths, the steering program in tun_select_queue().
+ */
+static int tun_set_bpf(struct sk_filter __rcu **slot, void __user *argp)
+{
+	struct sk_filter *filter = NULL, *old;
+	struct sock_fprog_kern kprog;
+	struct sock_filter *insns;
+	struct sock_fprog fprog;
+	int err;
+
+	if (copy_from_user(&fprog, argp, sizeof(fprog)))
+		return -EFAULT;
+
+	if (fprog.len) {
+		if (fprog.len > BPF_MAXINSNS)
+			return -EINVAL;
+		insns = memdup_user(fprog.filter,
+				    fprog.len * sizeof(struct sock_filter));
+		if (IS_ERR(insns))
+			return PTR_ERR(insns);
+
+		kprog.len = fprog.len;
+		kprog.filter = insns;
+		err = sk_unattached_filter_create(&filter, &kprog);
+		kfree(insns);
+		if (err)
+			return err;
+	}
+
+	old = rtnl_dereference(*slot);
+	rcu_assign_pointer(*slot, filter);
+	if (old) {
+		/* Frees the program at once, wait for the readers */
+		synchronize_net();
+		sk_unattached_filter_destroy(old);
+	}
+
+	return 0;
+}
+
+static void tun_free_bpf(struct sk_filter __rcu **slot)
+{
+	struct sk_filter *filter = rcu_dereference_raw(*slot);
+
+	if (filter)
+		sk_unattached_filter_destroy(filter);
+}
+
+static int tun_set_inj_policer(struct tun_struct *tun, void __user *argp)
+{
+	struct tun_inj_policer req;
+	struct tun_policer *p;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (req.index >= TUN_INJ_POLICERS || req.reserved)
+		return -EINVAL;
+
+	p = &tun->inj_policers[req.index];
+	spin_lock(&p->lock);
+	p->cost = req.rate ? div_u64(NSEC_PER_SEC, req.rate) : 0;
+	p->depth = p->cost * max_t(u32, req.burst, 1);
+	p->tokens = p->depth;
+	p->last = ktime_to_ns(ktime_get());
+	spin_unlock(&p->lock);
+
+	return 0;
+}
+
 static void tun_free_netdev(struct net_device *dev)
 {
 	struct tun_struct *tun = netdev_priv(dev);
 
 	BUG_ON(!(list_empty(&tun->disabled)));
+	tun_free_bpf(&tun->inj_filter);
+	tun_free_bpf(&tun->steering_filter);
+	free_percpu(tun->pcpu_stats);
 	tun_flow_uninit(tun);
 	security_tun_dev_free_security(tun->security);
 	free_netdev(dev);
@@ -1465,7 +2530,7 @@ static int tun_sendmsg(struct kiocb *iocb, struct socket *sock,
 	if (!tun)
 		return -EBADFD;
 	ret = tun_get_user(tun, tfile, m->msg_control, m->msg_iov, total_len,
-			   m->msg_iovlen, m->msg_flags & MSG_DONTWAIT);
+			   m->msg_iovlen, m->msg_flags & MSG_DONTWAIT, NULL);
 	tun_put(tun);
 	return ret;
 }
@@ -1548,6 +2613,9 @@ static int tun_flags(struct tun_struct *tun)
 	if (tun->flags & TUN_PERSIST)
 		flags |= IFF_PERSIST;
 
+	if (tun->flags & TUN_NAPI)
+		flags |= IFF_NAPI;
+
 	return flags;
 }
 
@@ -1587,7 +2655,7 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 	struct tun_struct *tun;
 	struct tun_file *tfile = file->private_data;
 	struct net_device *dev;
-	int err;
+	int i, err;
 
 	if (tfile->detached)
 		return -EINVAL;
@@ -1613,7 +2681,8 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		if (err < 0)
 			return err;
 
-		err = tun_attach(tun, file, ifr->ifr_flags & IFF_NOFILTER);
+		err = tun_attach(tun, file, ifr->ifr_flags & IFF_NOFILTER,
+				 ifr->ifr_flags & IFF_NAPI);
 		if (err < 0)
 			return err;
 
@@ -1671,14 +2740,23 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		tun->filter_attached = false;
 		tun->sndbuf = tfile->socket.sk->sk_sndbuf;
 
-		spin_lock_init(&tun->lock);
+		tun->pcpu_stats = netdev_alloc_pcpu_stats(struct tun_pcpu_stats);
+		if (!tun->pcpu_stats) {
+			err = -ENOMEM;
+			goto err_free_dev;
+		}
+
+		for (i = 0; i < TUN_INJ_POLICERS; i++)
+			spin_lock_init(&tun->inj_policers[i].lock);
 
 		err = security_tun_dev_alloc_security(&tun->security);
 		if (err < 0)
 			goto err_free_dev;
 
 		tun_net_init(dev);
-		tun_flow_init(tun);
+		err = tun_flow_init(tun);
+		if (err < 0)
+			goto err_free_security;
 
 		dev->hw_features = NETIF_F_SG | NETIF_F_FRAGLIST |
 				   TUN_USER_FEATURES | NETIF_F_HW_VLAN_CTAG_TX |
@@ -1689,7 +2767,7 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 				       NETIF_F_HW_VLAN_STAG_TX);
 
 		INIT_LIST_HEAD(&tun->disabled);
-		err = tun_attach(tun, file, false);
+		err = tun_attach(tun, file, false, ifr->ifr_flags & IFF_NAPI);
 		if (err < 0)
 			goto err_free_flow;
 
@@ -1730,6 +2808,11 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 	else
 		tun->flags &= ~TUN_TAP_MQ;
 
+	if (ifr->ifr_flags & IFF_NAPI)
+		tun->flags |= TUN_NAPI;
+	else
+		tun->flags &= ~TUN_NAPI;
+
 	/* Make sure persistent devices do not get stuck in
 	 * xoff state.
 	 */
@@ -1743,8 +2826,10 @@ err_detach:
 	tun_detach_all(dev);
 err_free_flow:
 	tun_flow_uninit(tun);
+err_free_security:
 	security_tun_dev_free_security(tun->security);
 err_free_dev:
+	free_percpu(tun->pcpu_stats);
 	free_netdev(dev);
 	return err;
 }
@@ -1859,7 +2944,7 @@ static int tun_set_queue(struct file *file, struct ifreq *ifr)
 		ret = security_tun_dev_attach_queue(tun->security);
 		if (ret < 0)
 			goto unlock;
-		ret = tun_attach(tun, file, false);
+		ret = tun_attach(tun, file, false, tun->flags & TUN_NAPI);
 	} else if (ifr->ifr_flags & IFF_DETACH_QUEUE) {
 		tun = rtnl_dereference(tfile->tun);
 		if (!tun || !(tun->flags & TUN_TAP_MQ) || tfile->detached)
@@ -1899,10 +2984,16 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		 * This is needed because we never checked for invalid flags on
 		 * TUNSETIFF. */
 		return put_user(IFF_TUN | IFF_TAP | IFF_NO_PI | IFF_ONE_QUEUE |
-				IFF_VNET_HDR | IFF_MULTI_QUEUE,
+				IFF_VNET_HDR | IFF_MULTI_QUEUE | IFF_NAPI,
 				(unsigned int __user*)argp);
 	} else if (cmd == TUNSETQUEUE)
 		return tun_set_queue(file, &ifr);
+	else if (cmd == TUNREADBATCH)
+		return tun_read_batch(file, argp);
+	else if (cmd == TUNWRITEBATCH)
+		return tun_write_batch(file, argp);
+	else if (cmd == TUNRINGSEND)
+		return tun_ring_send(file);
 
 	ret = 0;
 	rtnl_lock();
@@ -2116,6 +3207,38 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		ret = 0;
 		break;
 
+	case TUNSETRING:
+		ret = tun_set_ring(tfile, argp);
+		break;
+
+	case TUNSETINJFILTER:
+		ret = tun_set_bpf(&tun->inj_filter, argp);
+		break;
+
+	case TUNSETINJPOLICER:
+		ret = tun_set_inj_policer(tun, argp);
+		break;
+
+	case TUNSETFLOWCFG:
+		ret = tun_set_flow_cfg(tun, argp);
+		break;
+
+	case TUNSETSTEERINGBPF:
+		ret = tun_set_bpf(&tun->steering_filter, argp);
+		break;
+
+	case TUNGETFLOWCFG:
+		{
+			struct tun_flow_cfg cfg = {
+				.ageing_ms = jiffies_to_msecs(tun->ageing_time),
+				.max_flows = tun->max_flows,
+			};
+
+			if (copy_to_user(argp, &cfg, sizeof(cfg)))
+				ret = -EFAULT;
+		}
+		break;
+
 	default:
 		ret = -EINVAL;
 		break;
@@ -2135,15 +3258,63 @@ static long tun_chr_ioctl(struct file *file,
 }
 
 #ifdef CONFIG_COMPAT
+/* The sock_fprog ioctls encode the size of the structure, which differs
+ * for 32 bit callers.
+ */
+#define TUNSETINJFILTER32	_IOW('T', 244, struct compat_sock_fprog)
+#define TUNSETSTEERINGBPF32	_IOW('T', 248, struct compat_sock_fprog)
+
+/* Convert the 32 bit sock_fprog at arg to a native one in user space, for
+ * tun_set_bpf(). Returns NULL on a fault.
+ */
+static struct sock_fprog __user *tun_compat_fprog(unsigned long arg)
+{
+	struct compat_sock_fprog __user *fprog32 = compat_ptr(arg);
+	struct sock_fprog __user *fprog;
+	compat_uptr_t filter;
+	u16 len;
+
+	fprog = compat_alloc_user_space(sizeof(*fprog));
+	if (get_user(len, &fprog32->len) ||
+	    get_user(filter, &fprog32->filter) ||
+	    put_user(len, &fprog->len) ||
+	    put_user(compat_ptr(filter), &fprog->filter))
+		return NULL;
+
+	return fprog;
+}
+
 static long tun_chr_compat_ioctl(struct file *file,
 			 unsigned int cmd, unsigned long arg)
 {
+	struct sock_fprog __user *fprog;
+
 	switch (cmd) {
+	case TUNSETINJFILTER32:
+		fprog = tun_compat_fprog(arg);
+		if (!fprog)
+			return -EFAULT;
+		cmd = TUNSETINJFILTER;
+		arg = (unsigned long)fprog;
+		break;
+	case TUNSETSTEERINGBPF32:
+		fprog = tun_compat_fprog(arg);
+		if (!fprog)
+			return -EFAULT;
+		cmd = TUNSETSTEERINGBPF;
+		arg = (unsigned long)fprog;
+		break;
 	case TUNSETIFF:
 	case TUNGETIFF:
 	case TUNSETTXFILTER:
 	case TUNGETSNDBUF:
 	case TUNSETSNDBUF:
+	case TUNREADBATCH:
+	case TUNWRITEBATCH:
+	case TUNSETRING:
+	case TUNSETINJPOLICER:
+	case TUNSETFLOWCFG:
+	case TUNGETFLOWCFG:
 	case SIOCGIFHWADDR:
 	case SIOCSIFHWADDR:
 		arg = (unsigned long)compat_ptr(arg);
@@ -2197,6 +3368,7 @@ static int tun_chr_open(struct inode *inode, struct file * file)
 	tfile->net = get_net(current->nsproxy->net_ns);
 	tfile->flags = 0;
 	tfile->ifindex = 0;
+	RCU_INIT_POINTER(tfile->ring, NULL);
 
 	init_waitqueue_head(&tfile->wq.wait);
 	RCU_INIT_POINTER(tfile->socket.wq, &tfile->wq);
@@ -2222,9 +3394,14 @@ static int tun_chr_open(struct inode *inode, struct file * file)
 static int tun_chr_close(struct inode *inode, struct file *file)
 {
 	struct tun_file *tfile = file->private_data;
+	struct tun_ring *ring = rcu_dereference_raw(tfile->ring);
 	struct net *net = tfile->net;
 
+	/* tfile may be gone once detached; detaching waits for tun_net_xmit()
+	 * to be done with the ring.
+	 */
 	tun_detach(tfile, true);
+	tun_free_ring(ring);
 	put_net(net);
 
 	return 0;
@@ -2260,6 +3437,7 @@ static const struct file_operations tun_fops = {
 	.aio_write = tun_chr_aio_write,
 	.poll	= tun_chr_poll,
 	.unlocked_ioctl	= tun_chr_ioctl,
+	.mmap	= tun_chr_mmap,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl = tun_chr_compat_ioctl,
 #endif
@@ -2330,6 +3508,37 @@ static void tun_set_msglevel(struct net_device *dev, u32 value)
 #endif
 }
 
+static int tun_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return TUN_DROP_MAX;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void tun_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	if (sset == ETH_SS_STATS)
+		memcpy(data, tun_drop_strings, sizeof(tun_drop_strings));
+}
+
+static void tun_get_ethtool_stats(struct net_device *dev,
+				  struct ethtool_stats *estats, u64 *data)
+{
+	struct tun_struct *tun = netdev_priv(dev);
+	int i, j;
+
+	memset(data, 0, TUN_DROP_MAX * sizeof(*data));
+	for_each_possible_cpu(i) {
+		struct tun_pcpu_stats *p = per_cpu_ptr(tun->pcpu_stats, i);
+
+		for (j = 0; j < TUN_DROP_MAX; j++)
+			data[j] += p->drops[j];
+	}
+}
+
 static const struct ethtool_ops tun_ethtool_ops = {
 	.get_settings	= tun_get_settings,
 	.get_drvinfo	= tun_get_drvinfo,
@@ -2337,9 +3546,36 @@ static const struct ethtool_ops tun_ethtool_ops = {
 	.set_msglevel	= tun_set_msglevel,
 	.get_link	= ethtool_op_get_link,
 	.get_ts_info	= ethtool_op_get_ts_info,
+	.get_sset_count	= tun_get_sset_count,
+	.get_strings	= tun_get_strings,
+	.get_ethtool_stats = tun_get_ethtool_stats,
 };
 
 
+static void tun_free_inj_skbs(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree_skb(per_cpu(tun_inj_skb, cpu));
+}
+
+static int tun_alloc_inj_skbs(void)
+{
+	struct sk_buff *skb;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		skb = alloc_skb(TUN_INJ_PEEK, GFP_KERNEL);
+		if (!skb) {
+			tun_free_inj_skbs();
+			return -ENOMEM;
+		}
+		per_cpu(tun_inj_skb, cpu) = skb;
+	}
+	return 0;
+}
+
 static int __init tun_init(void)
 {
 	int ret = 0;
@@ -2347,6 +3583,10 @@ static int __init tun_init(void)
 	pr_info("%s, %s\n", DRV_DESCRIPTION, DRV_VERSION);
 	pr_info("%s\n", DRV_COPYRIGHT);
 
+	ret = tun_alloc_inj_skbs();
+	if (ret)
+		goto err_skbs;
+
 	ret = rtnl_link_register(&tun_link_ops);
 	if (ret) {
 		pr_err("Can't register link_ops\n");
@@ -2362,6 +3602,8 @@ static int __init tun_init(void)
 err_misc:
 	rtnl_link_unregister(&tun_link_ops);
 err_linkops:
+	tun_free_inj_skbs();
+err_skbs:
 	return ret;
 }
 
@@ -2369,6 +3611,7 @@ static void tun_cleanup(void)
 {
 	misc_deregister(&tun_miscdev);
 	rtnl_link_unregister(&tun_link_ops);
+	tun_free_inj_skbs();
 }
 
 /* Get an underlying socket object from tun file.  Returns error unless file is
@@ -0,0 +1,171 @@
+/*
+ *  bf_tun - extensions to the Universal TUN/TAP device driver interface
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+/* Private ioctls on top of <linux/if_tun.h>, shared between bf_tun and the
+ * user space driver that owns the CPU port netdevs. They use the 'T' type
+ * of the stock TUN ioctls, from number 240 up so as to stay clear of the
+ * upstream ones.
+ */
+
+#ifndef _BF_TUN_H_
+#define _BF_TUN_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/filter.h>
+
+/* TUNSETIFF flag: pass frames written to this queue through GRO, from a
+ * napi context of its own. Same value as the later upstream flag.
+ */
+#ifndef IFF_NAPI
+#define IFF_NAPI	0x0010
+#endif
+
+/* Most frames moved by one batch ioctl */
+#define TUN_BATCH_MAX	256
+
+/* One frame of a batch. buf and len describe a user buffer holding the
+ * frame exactly as read() returns it or write() takes it: struct tun_pi
+ * unless IFF_NO_PI, then the vnet header if IFF_VNET_HDR, then the packet.
+ */
+struct tun_batch_msg {
+	__u64 buf;
+	__u32 len;
+	__u32 reserved;
+};
+
+struct tun_batch {
+	__u64 msgs;		/* struct tun_batch_msg array */
+	__u32 count;		/* entries in msgs, at most TUN_BATCH_MAX */
+	__u32 flags;		/* must be 0 */
+};
+
+/* Read up to count frames from the queue. Only the first frame waits, and
+ * only if the file is blocking; the call then returns whatever else is
+ * already queued. Each msgs[i].len is updated with the length read, as
+ * read() would return it. Returns the number of frames read; an error is
+ * only returned if no frame was.
+ */
+#define TUNREADBATCH	_IOWR('T', 240, struct tun_batch)
+
+/* Write up to count frames, as that many write() calls would, and pass
+ * them to the stack together. Only the first frame waits for send buffer
+ * space, and only if the file is blocking. Returns the number of frames
+ * written; an error is only returned if no frame was.
+ */
+#define TUNWRITEBATCH	_IOW('T', 241, struct tun_batch)
+
+/* Shared memory rings, PACKET_MMAP style. TUNSETRING allocates rx_frame_nr
+ * rx frames followed by tx_frame_nr tx frames, frame_size bytes each, that
+ * the file then maps with mmap() at offset 0. A ring can be set up once
+ * per file and lives until the file is closed.
+ *
+ * Each frame starts with a struct tun_ring_hdr; the frame itself follows
+ * at TUN_RING_HDRLEN, laid out as for read() and write().
+ *
+ * rx: while set up, packets for the queue go to the ring instead of
+ * read(). The kernel fills frames in order and hands each one over by
+ * setting status to TUN_RING_USER; user space sets it back to
+ * TUN_RING_KERNEL once done with it. Packets are dropped while the next
+ * frame is still owned by user space. poll() reports POLLIN while the most
+ * recently filled frame is TUN_RING_USER.
+ *
+ * tx: user space fills frames in order, sets len and then status to
+ * TUN_RING_SEND_REQUEST, and calls TUNRINGSEND to inject all pending
+ * frames at once. The kernel sets status back to TUN_RING_AVAILABLE, or
+ * to TUN_RING_WRONG_FORMAT for a frame it rejected.
+ */
+#define TUN_RING_ALIGNMENT	16
+#define TUN_RING_MAX_SIZE	(64 << 20)
+
+struct tun_ring_req {
+	__u32 frame_size;	/* multiple of TUN_RING_ALIGNMENT */
+	__u32 rx_frame_nr;
+	__u32 tx_frame_nr;
+	__u32 flags;		/* must be 0 */
+};
+
+struct tun_ring_hdr {
+	__u32 status;
+	__u32 len;		/* bytes of frame data after the header */
+	__u32 reserved[2];
+};
+
+#define TUN_RING_HDRLEN		sizeof(struct tun_ring_hdr)
+
+/* rx status */
+#define TUN_RING_KERNEL		0
+#define TUN_RING_USER		1
+
+/* tx status */
+#define TUN_RING_AVAILABLE	0
+#define TUN_RING_SEND_REQUEST	1
+#define TUN_RING_WRONG_FORMAT	4
+
+#define TUNSETRING	_IOW('T', 242, struct tun_ring_req)
+/* Returns the number of tx frames consumed */
+#define TUNRINGSEND	_IO('T', 243)
+
+/* Injection filter. A classic BPF program run on every frame written to
+ * the device, before an skb is allocated for it. It sees the first
+ * TUN_INJ_PEEK bytes of the packet, starting at the Ethernet header on a
+ * TAP device and at the IP header on a TUN device. Its return value is
+ * the verdict:
+ *
+ *   0				drop the frame
+ *   TUN_INJ_POLICE(n)		pass it if policer n has a token, else drop
+ *   anything else		pass the frame
+ *
+ * Dropped frames are still reported as written, and are counted in the
+ * rx_drop_filter and rx_drop_policed ethtool statistics. TUNSETINJFILTER
+ * with a zero length program removes the filter.
+ */
+#define TUN_INJ_PEEK		128
+#define TUN_INJ_POLICERS	16
+#define TUN_INJ_POLICE_FLAG	0x80000000
+#define TUN_INJ_POLICE(n)	(TUN_INJ_POLICE_FLAG | (n))
+
+/* Token bucket policer, rate 0 lets everything through */
+struct tun_inj_policer {
+	__u32 index;		/* below TUN_INJ_POLICERS */
+	__u32 rate;		/* packets per second */
+	__u32 burst;		/* packets */
+	__u32 reserved;
+};
+
+#define TUNSETINJFILTER		_IOW('T', 244, struct sock_fprog)
+#define TUNSETINJPOLICER	_IOW('T', 245, struct tun_inj_policer)
+
+/* Flow steering table. A flow idle for ageing_ms is forgotten; no more than
+ * max_flows are tracked. The defaults are 3000 ms and 4096 flows.
+ */
+#define TUN_FLOWS_MAX		(1 << 20)
+
+struct tun_flow_cfg {
+	__u32 ageing_ms;
+	__u32 max_flows;	/* up to TUN_FLOWS_MAX */
+};
+
+#define TUNSETFLOWCFG		_IOW('T', 246, struct tun_flow_cfg)
+#define TUNGETFLOWCFG		_IOR('T', 247, struct tun_flow_cfg)
+
+/* Queue steering program. A classic BPF program run on every packet sent
+ * on a multiqueue device, in place of the flow table. The packet starts at
+ * the Ethernet header on a TAP device and at the IP header on a TUN
+ * device. The return value modulo the number of queues is the queue the
+ * packet is delivered to. A zero length program removes it.
+ */
+#define TUNSETSTEERINGBPF	_IOW('T', 248, struct sock_fprog)
+
+#endif /* _BF_TUN_H_ */